@@ -0,0 +1,9 @@
+// Generated by mkbuildins from LBUILDINS in repl.h, do not edit
+#define LBUILDIN_SEED 259961UL
+#define LBUILDIN_BITS 6
+static const signed char lbuildin_slots[1 << LBUILDIN_BITS] = {
+  10, -1, -1, -1, 16, 4, -1, 15, -1, 14, 19, -1, 21, 3, 29, -1,
+  1, -1, -1, 17, 32, 22, 6, -1, 2, 26, -1, 25, -1, -1, 27, -1,
+  -1, 7, -1, 5, -1, -1, -1, 18, 20, -1, -1, 23, -1, 0, -1, 33,
+  13, 12, -1, -1, 30, 28, -1, -1, -1, 9, 31, 11, 24, -1, -1, 8
+};
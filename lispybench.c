@@ -0,0 +1,203 @@
+// Benchmarks of the global frame variants, see lenv_share and lenv_fork.
+// Lookups: threads call a lambda reading globals of one shared frame
+// while the first of them redefines a name as it goes, for 1, 2, 4 ..
+// threads up to the number of cores. Sessions: requests that each get
+// a global frame of their own with the library in it, built by running
+// the library's definitions again or forked from one preloaded frame.
+//   lispybench [max threads]
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mpc.h"
+#include "repl.h"
+
+#define BENCH_GLOBALS 64
+#define BENCH_CALLS 2000 // calls of look per thread
+#define BENCH_DEPTH 1000 // the n each call starts from
+#define BENCH_TICK 64    // calls between redefinitions
+#define BENCH_LIB_DEFS 512
+#define BENCH_REQUESTS 2000
+
+static Lenv* shared;
+static Lval* call; // (look BENCH_DEPTH 0)
+static long expect;
+
+typedef struct {
+  bool writer;
+  int wrong; // results other than expect
+} Worker;
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static Lval* eval_string(Lenv* e, char* src) {
+  Lval* prog = lval_read_string("<bench>", src);
+  Lval* x = lval_sexp();
+  while (prog->type != LVAL_ERR && prog->count) {
+    lval_del(x);
+    x = lval_eval(e, lval_pop(prog, 0));
+  }
+  if (prog->type == LVAL_ERR) { lval_del(x); return prog; }
+  lval_del(prog);
+  return x;
+}
+
+static void* work(void* arg) {
+  Worker* w = arg;
+  for (int i = 0; i < BENCH_CALLS; i++) {
+    if (w->writer && i % BENCH_TICK == 0) {
+      // look reads v7, the value stays so results can be checked
+      lval_del(eval_string(shared, "(def {v7} 7)"));
+    }
+    Lval* x = lval_eval(shared, lval_copy(call));
+    if (x->type != LVAL_NUM || x->num != expect) { w->wrong++; }
+    lval_del(x);
+  }
+  return NULL;
+}
+
+static void bench_lookups(int max) {
+  shared = lenv_new();
+  lenv_init_buildins(shared);
+  char def[64];
+  for (int i = 0; i < BENCH_GLOBALS; i++) {
+    snprintf(def, sizeof(def), "(def {v%d} %d)", i, i);
+    lval_del(eval_string(shared, def));
+  }
+  lval_del(eval_string(shared,
+    "(def {look} (lambda {n acc} {if (== n 0) {acc} {look (- n 1) (+ acc v7 v21 v42 v63)}}))"));
+  lenv_share(shared);
+
+  Lval* prog = lval_read_string("<bench>", "(look 1000 0)");
+  call = lval_pop(prog, 0);
+  lval_del(prog);
+  expect = BENCH_DEPTH * (7 + 21 + 42 + 63L);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, leval_stack_limit());
+
+  printf("lookups, %d calls of %d steps per thread\n", BENCH_CALLS, BENCH_DEPTH);
+  for (int n = 1; n <= max; n *= 2) {
+    pthread_t threads[n];
+    Worker workers[n];
+    double t = now();
+    for (int i = 0; i < n; i++) {
+      workers[i] = (Worker){ i == 0, 0 };
+      pthread_create(&threads[i], &attr, work, &workers[i]);
+    }
+    int wrong = 0;
+    for (int i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+      wrong += workers[i].wrong;
+    }
+    t = now() - t;
+    lenv_quiesce();
+    printf("  %3d threads: %.3fs, %.0f calls/s%s\n", n, t, n * BENCH_CALLS / t,
+      wrong ? ", WRONG RESULTS" : "");
+    if (n < max && n * 2 > max) { n = max / 2; }
+  }
+
+  pthread_attr_destroy(&attr);
+  lval_del(call);
+  lenv_del(shared);
+}
+
+// the library a session starts with: stlib.lisp and BENCH_LIB_DEFS globals
+static Lval* read_library(void) {
+  FILE* f = fopen("stlib.lisp", "rb");
+  if (!f) { return lval_err("cannot read stlib.lisp"); }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* text = malloc(n + 1);
+  text[fread(text, 1, n, f)] = '\0';
+  fclose(f);
+  // the reader has no comments, imports skip them with lmod_skip_space
+  for (char* s = strchr(text, ';'); s; s = strchr(s, ';')) {
+    while (*s && *s != '\n') { *s++ = ' '; }
+  }
+
+  Lval* lib = lval_read_string("stlib.lisp", text);
+  free(text);
+  for (int i = 0; lib->type != LVAL_ERR && i < BENCH_LIB_DEFS; i++) {
+    char def[64];
+    snprintf(def, sizeof(def), "(def {v%d} %d)", i, i);
+    Lval* x = lval_read_string("<bench>", def);
+    lib = lval_add(lib, lval_pop(x, 0));
+    lval_del(x);
+  }
+  return lib;
+}
+
+// a request rebinds a library name in its own session only
+static Lval* req;
+
+static long request(Lenv* e) {
+  Lval* x = NULL;
+  for (int i = 0; i < req->count; i++) {
+    if (x) { lval_del(x); }
+    x = lval_eval(e, lval_copy(req->cell[i]));
+  }
+  long r = x->type == LVAL_NUM ? x->num : -1;
+  lval_del(x);
+  return r;
+}
+
+static int bench_sessions(void) {
+  Lval* lib = read_library();
+  if (lib->type == LVAL_ERR) {
+    fprintf(stderr, "lispybench: %s\n", lib->err);
+    lval_del(lib);
+    return 1;
+  }
+  req = lval_read_string("<bench>", "(def {v3} 100) (+ v3 v4 (eval (nth 2 {1 2 3})))");
+  printf("sessions, %d requests against %d definitions\n", BENCH_REQUESTS, lib->count);
+
+  long sum = 0;
+  double t = now();
+  for (int i = 0; i < BENCH_REQUESTS; i++) {
+    Lenv* e = lenv_new();
+    lenv_init_buildins(e);
+    for (int j = 0; j < lib->count; j++) { lval_del(lval_eval(e, lval_copy(lib->cell[j]))); }
+    sum += request(e);
+    lenv_del(e);
+  }
+  printf("  definitions run again: %.3fs, results %ld\n", now() - t, sum);
+
+  Lenv* g = lenv_new();
+  lenv_init_buildins(g);
+  for (int j = 0; j < lib->count; j++) { lval_del(lval_eval(g, lval_copy(lib->cell[j]))); }
+  sum = 0;
+  t = now();
+  for (int i = 0; i < BENCH_REQUESTS; i++) {
+    Lenv* e = lenv_fork(g);
+    sum += request(e);
+    lenv_del(e);
+  }
+  t = now() - t;
+  Lval* v3 = eval_string(g, "v3");
+  printf("  forked: %.3fs, results %ld, v3 left at %ld\n", t, sum, v3->num);
+
+  lval_del(v3);
+  lenv_del(g);
+  lval_del(req);
+  lval_del(lib);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  int max = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (max < 1) { max = 1; }
+
+  lval_parser_init();
+  bench_lookups(max);
+  int r = bench_sessions();
+  lval_parser_cleanup();
+  return r;
+}
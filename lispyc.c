@@ -0,0 +1,398 @@
+// Translates a Lispy program to C that links against repl.c. The lambdas
+// of integers the program defines, see LJIT_ENABLE, become C functions
+// on unboxed longs which call each other directly, the program itself
+// runs through lval_run and gets their code installed.
+//   lispyc prog.lisp > prog.c
+#include <stdarg.h>
+#include <string.h>
+#include "mpc.h"
+#include "repl.h"
+
+// a lambda the program defines under a name at its top level
+typedef struct {
+  char* name;
+  Lval* formals;
+  Lval* body;
+  bool ints; // still taken for a lambda of integers
+  int form; // index of the top level form that makes it
+} Cfun;
+
+static Cfun* funs = NULL;
+static int nfuns = 0;
+
+// how often each name is defined anywhere in the program
+static char** defined = NULL;
+static int* ndefined = NULL;
+static int ndefs = 0;
+
+static char* ops[] = { "+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=" };
+#define NOPS ((int)(sizeof(ops) / sizeof(ops[0])))
+
+// generated code, appended to with emit
+static char* out = NULL;
+static int outn = 0;
+static int temps = 0;
+static bool jumps = false; // the function being generated loops
+
+static void emit(char* fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  int n = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+  out = realloc(out, outn + n + 1);
+  va_start(va, fmt);
+  vsnprintf(out + outn, n + 1, fmt, va);
+  va_end(va);
+  outn += n;
+}
+
+// s as the inside of a C string literal, split after each line when
+// lines is set
+static void emit_quoted(char* s, bool lines) {
+  for (; *s; s++) {
+    if (*s == '\n' && lines) { emit("\\n\"\n  \""); continue; }
+    if (*s == '"' || *s == '\\') { emit("\\%c", *s); continue; }
+    if ((unsigned char)*s < ' ') { emit("\\%03o", *s); continue; }
+    emit("%c", *s);
+  }
+}
+
+static char* str(char* fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  int n = vsnprintf(NULL, 0, fmt, va);
+  va_end(va);
+  char* s = malloc(n + 1);
+  va_start(va, fmt);
+  vsnprintf(s, n + 1, fmt, va);
+  va_end(va);
+  return s;
+}
+
+static bool is_sym(Lval* v, char* s) {
+  return v->type == LVAL_SYM && strcmp(v->sym, s) == 0;
+}
+
+static int times_defined(char* s) {
+  for (int i = 0; i < ndefs; i++) {
+    if (strcmp(defined[i], s) == 0) { return ndefined[i]; }
+  }
+  return 0;
+}
+
+static void define(char* s) {
+  for (int i = 0; i < ndefs; i++) {
+    if (strcmp(defined[i], s) == 0) { ndefined[i]++; return; }
+  }
+  defined = realloc(defined, sizeof(char*) * (ndefs + 1));
+  ndefined = realloc(ndefined, sizeof(int) * (ndefs + 1));
+  defined[ndefs] = s;
+  ndefined[ndefs++] = 1;
+}
+
+// count the names every def, = and fun in v binds
+static void scan_defs(Lval* v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+  if (v->type == LVAL_SEXPR && v->count >= 2 && v->cell[1]->type == LVAL_QEXPR) {
+    Lval* names = v->cell[1];
+    bool fun = is_sym(v->cell[0], "fun");
+    if (fun || is_sym(v->cell[0], "def") || is_sym(v->cell[0], "=")) {
+      for (int i = 0; i < (fun ? 1 : names->count) && i < names->count; i++) {
+        if (names->cell[i]->type == LVAL_SYM) { define(names->cell[i]->sym); }
+      }
+    }
+  }
+  for (int i = 0; i < v->count; i++) { scan_defs(v->cell[i]); }
+}
+
+static bool all_syms(Lval* v) {
+  for (int i = 0; i < v->count; i++) {
+    if (v->cell[i]->type != LVAL_SYM) { return false; }
+  }
+  return true;
+}
+
+// (fun {name formals...} {body}) or (def {name} (lambda {formals} {body})),
+// top level form number form
+static void find_fun(Lval* v, int form) {
+  if (v->type != LVAL_SEXPR || v->count != 3 || v->cell[1]->type != LVAL_QEXPR) { return; }
+  Lval* names = v->cell[1];
+  Cfun f = { NULL, NULL, NULL, true, form };
+
+  if (is_sym(v->cell[0], "fun") && names->count >= 1 && all_syms(names)
+      && v->cell[2]->type == LVAL_QEXPR) {
+    f.name = names->cell[0]->sym;
+    f.formals = lval_qexp();
+    for (int i = 1; i < names->count; i++) { lval_add(f.formals, lval_copy(names->cell[i])); }
+    f.body = v->cell[2];
+  }
+
+  Lval* l = v->cell[2];
+  if (is_sym(v->cell[0], "def") && names->count == 1 && names->cell[0]->type == LVAL_SYM
+      && l->type == LVAL_SEXPR && l->count == 3
+      && (is_sym(l->cell[0], "lambda") || is_sym(l->cell[0], "\\"))
+      && l->cell[1]->type == LVAL_QEXPR && all_syms(l->cell[1]) && l->cell[2]->type == LVAL_QEXPR) {
+    f.name = names->cell[0]->sym;
+    f.formals = lval_copy(l->cell[1]);
+    f.body = l->cell[2];
+  }
+
+  if (!f.name || f.formals->count == 0 || f.formals->count > LJIT_ARGS_MAX) { return; }
+  funs = realloc(funs, sizeof(Cfun) * (nfuns + 1));
+  funs[nfuns++] = f;
+}
+
+static int formal(Cfun* f, Lval* v) {
+  if (v->type != LVAL_SYM) { return -1; }
+  for (int i = f->formals->count - 1; i >= 0; i--) {
+    if (strcmp(f->formals->cell[i]->sym, v->sym) == 0) { return i; }
+  }
+  return -1;
+}
+
+static int op(Cfun* f, Lval* v) {
+  if (v->type != LVAL_SYM || formal(f, v) >= 0) { return -1; }
+  for (int i = 0; i < NOPS; i++) {
+    if (strcmp(ops[i], v->sym) == 0) { return times_defined(v->sym) ? -1 : i; }
+  }
+  return -1;
+}
+
+// the lambda of integers a call head names, -1 if there is none
+static int callee(Cfun* f, Lval* v) {
+  if (v->type != LVAL_SYM || formal(f, v) >= 0) { return -1; }
+  for (int i = 0; i < nfuns; i++) {
+    if (funs[i].ints && strcmp(funs[i].name, v->sym) == 0) { return i; }
+  }
+  return -1;
+}
+
+static bool check_list(Cfun* f, Lval* v);
+
+// whether v is an integer once the formals are
+static bool check(Cfun* f, Lval* v) {
+  if (v->type == LVAL_SEXPR) { return check_list(f, v); }
+  return v->type == LVAL_NUM || formal(f, v) >= 0;
+}
+
+static bool check_list(Cfun* f, Lval* v) {
+  if (v->count == 0) { return false; }
+  if (v->count == 1) { return check(f, v->cell[0]); }
+
+  Lval* h = v->cell[0];
+  if (is_sym(h, "if") && formal(f, h) < 0 && !times_defined("if")) {
+    return v->count == 4 && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR
+      && check(f, v->cell[1]) && check_list(f, v->cell[2]) && check_list(f, v->cell[3]);
+  }
+
+  if (op(f, h) >= 0) {
+    return v->count == 3 && check(f, v->cell[1]) && check(f, v->cell[2]);
+  }
+
+  int c = callee(f, h);
+  if (c < 0 || funs[c].formals->count != v->count - 1) { return false; }
+  for (int i = 1; i < v->count; i++) {
+    if (!check(f, v->cell[i])) { return false; }
+  }
+  return true;
+}
+
+static char* gen_list(Cfun* f, Lval* v, bool tail, int indent);
+
+// emit statements computing v, returns the C expression holding it or
+// NULL when a tail call of f itself jumped back to its start
+static char* gen(Cfun* f, Lval* v, bool tail, int indent) {
+  if (v->type == LVAL_SEXPR) { return gen_list(f, v, tail, indent); }
+  if (v->type == LVAL_NUM) {
+    return v->num == LONG_MIN ? str("(-%ldL - 1)", LONG_MAX) : str("%ldL", v->num);
+  }
+  return str("a%d", formal(f, v));
+}
+
+static char* gen_list(Cfun* f, Lval* v, bool tail, int indent) {
+  if (v->count == 1) { return gen(f, v->cell[0], tail, indent); }
+
+  Lval* h = v->cell[0];
+  char* t = str("t%d", temps++);
+
+  if (is_sym(h, "if") && formal(f, h) < 0) {
+    char* c = gen(f, v->cell[1], false, indent);
+    emit("%*slong %s = 0;\n", indent, "", t);
+    emit("%*sif (%s) {\n", indent, "", c);
+    char* x = gen_list(f, v->cell[2], tail, indent + 2);
+    if (x) { emit("%*s%s = %s;\n", indent + 2, "", t, x); }
+    emit("%*s} else {\n", indent, "");
+    char* y = gen_list(f, v->cell[3], tail, indent + 2);
+    if (y) { emit("%*s%s = %s;\n", indent + 2, "", t, y); }
+    emit("%*s}\n", indent, "");
+    free(c); free(x); free(y);
+    return t;
+  }
+
+  int o = op(f, h);
+  if (o >= 0) {
+    char* x = gen(f, v->cell[1], false, indent);
+    char* y = gen(f, v->cell[2], false, indent);
+    char* name = ops[o];
+    // the builtin reports overflow and division by zero
+    if (strcmp(name, "/") == 0 || strcmp(name, "%") == 0) {
+      emit("%*sif (%s == 0 || %s == -1) { LISPY_BAIL; }\n", indent, "", y, y);
+      emit("%*slong %s = %s %s %s;\n", indent, "", t, x, name, y);
+    } else if (strlen(name) == 1 && strchr("+-*", name[0])) {
+      char* kernel = name[0] == '+' ? "add" : name[0] == '-' ? "sub" : "mul";
+      emit("%*slong %s;\n", indent, "", t);
+      emit("%*sif (__builtin_%s_overflow(%s, %s, &%s)) { LISPY_BAIL; }\n", indent, "", kernel, x, y, t);
+    } else {
+      emit("%*slong %s = %s %s %s;\n", indent, "", t, x, name, y);
+    }
+    free(x); free(y);
+    return t;
+  }
+
+  int c = callee(f, h);
+  int argn = v->count - 1;
+  char** args = malloc(sizeof(char*) * argn);
+  for (int i = 0; i < argn; i++) { args[i] = gen(f, v->cell[i + 1], false, indent); }
+
+  if (tail && &funs[c] == f) {
+    // a tail call of itself loops, every argument is computed first
+    for (int i = 0; i < argn; i++) {
+      emit("%*slong n%d_%d = %s;\n", indent, "", temps, i, args[i]);
+    }
+    for (int i = 0; i < argn; i++) {
+      emit("%*sa%d = n%d_%d;\n", indent, "", i, temps, i);
+    }
+    emit("%*sgoto start;\n", indent, "");
+    jumps = true;
+    temps++;
+    for (int i = 0; i < argn; i++) { free(args[i]); }
+    free(args);
+    free(t);
+    return NULL;
+  }
+
+  emit("%*slong %s = lispy_f%d(", indent, "", t, c);
+  for (int i = 0; i < argn; i++) { emit("%s, ", args[i]); free(args[i]); }
+  emit("bail);\n");
+  emit("%*sif (*bail) { leval_depth--; return 0; }\n", indent, "");
+  free(args);
+  return t;
+}
+
+static void gen_fun(int i) {
+  Cfun* f = &funs[i];
+  emit("\n// %s\n", f->name);
+  emit("static long lispy_f%d(", i);
+  for (int j = 0; j < f->formals->count; j++) { emit("long a%d, ", j); }
+  emit("int* bail) {\n");
+  emit("  if (leval_depth >= LEVAL_DEPTH_MAX) { *bail = 1; return 0; }\n");
+  emit("  leval_depth++;\n");
+  temps = 0;
+  jumps = false;
+  int at = outn;
+  char* r = gen_list(f, f->body, true, 2);
+  if (jumps) {
+    char* label = "start:;\n";
+    int n = strlen(label);
+    out = realloc(out, outn + n + 1);
+    memmove(out + at + n, out + at, outn - at + 1);
+    memcpy(out + at, label, n);
+    outn += n;
+  }
+  emit("  leval_depth--;\n");
+  emit("  return %s;\n}\n", r ? r : "0");
+  free(r);
+
+  emit("\nstatic Ljit_ret lispy_e%d(long* args, Lenv* glob) {\n", i);
+  emit("  int bail = 0;\n");
+  emit("  long r = lispy_f%d(", i);
+  for (int j = 0; j < f->formals->count; j++) { emit("args[%d], ", j); }
+  emit("&bail);\n");
+  emit("  return (Ljit_ret){ r, bail };\n}\n");
+}
+
+static char* read_file(char* path) {
+  FILE* f = fopen(path, "rb");
+  if (!f) { return NULL; }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* text = malloc(n + 1);
+  text[fread(text, 1, n, f)] = '\0';
+  fclose(f);
+  return text;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: lispyc prog.lisp > prog.c\n");
+    return 2;
+  }
+  char* text = read_file(argv[1]);
+  if (!text) {
+    fprintf(stderr, "lispyc: cannot read %s\n", argv[1]);
+    return 1;
+  }
+
+  lval_parser_init();
+  Lval* prog = lval_read_string(argv[1], text);
+  if (prog->type == LVAL_ERR) {
+    fprintf(stderr, "lispyc: %s\n", prog->err);
+    return 1;
+  }
+
+  scan_defs(prog);
+  for (int i = 0; i < prog->count; i++) { find_fun(prog->cell[i], i); }
+
+  // a name bound more than once may change meaning, and a lambda stays
+  // taken for one of integers until it calls one that is not
+  for (int i = 0; i < nfuns; i++) {
+    funs[i].ints = times_defined(funs[i].name) == 1;
+  }
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (int i = 0; i < nfuns; i++) {
+      if (funs[i].ints && !check_list(&funs[i], funs[i].body)) {
+        funs[i].ints = false;
+        changed = true;
+      }
+    }
+  }
+
+  // the path is quoted, a backslash ending the line would carry the
+  // comment on to the next
+  emit("// Generated by lispyc from \"");
+  emit_quoted(argv[1], false);
+  emit("\", do not edit\n");
+  emit("#include \"mpc.h\"\n#include \"repl.h\"\n\n");
+  emit("#define LISPY_BAIL { *bail = 1; leval_depth--; return 0; }\n\n");
+  for (int i = 0; i < nfuns; i++) {
+    if (!funs[i].ints) { continue; }
+    emit("static long lispy_f%d(", i);
+    for (int j = 0; j < funs[i].formals->count; j++) { emit("long a%d, ", j); }
+    emit("int* bail);\n");
+  }
+  int naot = 0;
+  for (int i = 0; i < nfuns; i++) {
+    if (funs[i].ints) { gen_fun(i); naot++; }
+  }
+
+  emit("\nstatic Laot lispy_aot[] = {\n");
+  for (int i = 0; i < nfuns; i++) {
+    if (funs[i].ints) { emit("  { \"%s\", lispy_e%d, %d },\n", funs[i].name, i, funs[i].form); }
+  }
+  emit("  { NULL, NULL, -1 }\n};\n\n");
+
+  emit("static char lispy_src[] =\n  \"");
+  emit_quoted(text, true);
+  emit("\";\n\n");
+  emit("int main(void) {\n");
+  emit("  return lval_run(\"");
+  emit_quoted(argv[1], false);
+  emit("\", lispy_src, lispy_aot, %d);\n}\n", naot);
+
+  fwrite(out, 1, outn, stdout);
+  lval_del(prog);
+  lval_parser_cleanup();
+  return 0;
+}
@@ -0,0 +1,50 @@
+// Generates buildins.h: a multiplicative perfect hash from the names in
+// LBUILDINS to their position in it, used by the builtin table in repl.c
+#include "mpc.h"
+#include "repl.h"
+
+#define X(name, kind, v) name,
+static char* names[] = { LBUILDINS(X) };
+#undef X
+
+// must match lsym_hash in repl.c
+static unsigned long hash(char* s) {
+  unsigned long h = 14695981039346656037UL;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+int main(void) {
+  int n = sizeof(names) / sizeof(names[0]);
+  int width = sizeof(unsigned long) * CHAR_BIT;
+  signed char slots[1 << 10];
+
+  for (int bits = 5; bits <= 10; bits++) {
+    for (unsigned long seed = 1; seed < (1UL << 24); seed += 2) {
+      memset(slots, -1, sizeof(slots));
+      int i;
+      for (i = 0; i < n; i++) {
+        unsigned long s = (hash(names[i]) * seed) >> (width - bits);
+        if (slots[s] >= 0) { break; }
+        slots[s] = i;
+      }
+      if (i < n) { continue; }
+
+      printf("// Generated by mkbuildins from LBUILDINS in repl.h, do not edit\n");
+      printf("#define LBUILDIN_SEED %luUL\n", seed);
+      printf("#define LBUILDIN_BITS %d\n", bits);
+      printf("static const signed char lbuildin_slots[1 << LBUILDIN_BITS] = {");
+      for (int j = 0; j < (1 << bits); j++) {
+        printf("%s%d", j == 0 ? "\n  " : j % 16 ? ", " : ",\n  ", slots[j]);
+      }
+      printf("\n};\n");
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "mkbuildins: no perfect hash for %d names\n", n);
+  return 1;
+}
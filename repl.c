@@ -1,7 +1,14 @@
+// MAP_ANONYMOUS is left out by -std=c99
+#define _DEFAULT_SOURCE
 #include <readline/readline.h>
 #include <readline/history.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include "mpc.h"
 #include "repl.h"
+#include "buildins.h"
 #define DEBUG 0
 
 char* ltype_name(int t) {
@@ -17,9 +24,136 @@ char* ltype_name(int t) {
   }
 }
 
+// the builtin table, values are never freed, lookups hand out copies
+#define LBUILDIN_FUN(v) { .type = LVAL_FUN, .buildin = v }
+#define LBUILDIN_BOOL(v) { .type = LVAL_BOOL, .num = v }
+#define X(name, kind, v) LBUILDIN_##kind(v),
+static Lval lbuildin_vals[] = { LBUILDINS(X) };
+#undef X
+#define X(name, kind, v) name,
+static char* lbuildin_names[] = { LBUILDINS(X) };
+#undef X
+
+// position of k in LBUILDINS, -1 if it names no builtin
+static int lbuildin_find(Lval* k) {
+  int i = lbuildin_slots[(k->hash * LBUILDIN_SEED) >> (sizeof(unsigned long) * CHAR_BIT - LBUILDIN_BITS)];
+  return i >= 0 && strcmp(lbuildin_names[i], k->sym) == 0 ? i : -1;
+}
+
+// free slots of the value heap, each thread allocates from its own
+static __thread Lval* lval_free_list = NULL;
+
+// free slots threads left behind when they ended, taken up again by
+// threads that run out
+static Lval* lval_spare = NULL;
+static pthread_mutex_t lval_spare_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lthread_track(void);
+
+// lists waiting to be released, a ring buffer
+static __thread Lval* lval_defer_queue[LVAL_DEFER_DEPTH];
+static __thread int lval_defer_head = 0;
+static __thread int lval_defer_len = 0;
+
+// the call stack region, allocated on a thread's first call, and its
+// first free entry
+static __thread Lentry* lenv_stack = NULL;
+static __thread int lenv_sp = 0;
+
+// the walk stack, a walk started inside another one works above it
+static __thread Lwork* lwalk_stack = NULL;
+static __thread int lwalk_sp = 0;
+static __thread int lwalk_cap = 0;
+
+static void lwalk_push(Lval* v, Lval* w, int i) {
+  if (lwalk_sp == lwalk_cap) {
+    if (!lwalk_stack) { lthread_track(); }
+    lwalk_cap = lwalk_cap ? lwalk_cap * 2 : 256;
+    lwalk_stack = realloc(lwalk_stack, sizeof(Lwork) * lwalk_cap);
+  }
+  lwalk_stack[lwalk_sp++] = (Lwork){ v, w, i };
+}
+
+// calls in progress on this thread
+__thread int leval_depth = 0;
+
+// where the outermost call on this thread started and how far below it
+// calls may go, 0 until the thread's first call
+static __thread char* leval_stack_base = NULL;
+static __thread long leval_stack_budget = 0;
+
+long leval_stack_limit(void) {
+  struct rlimit r;
+  if (getrlimit(RLIMIT_STACK, &r) == 0 && r.rlim_cur != RLIM_INFINITY) { return r.rlim_cur; }
+  return 8L << 20;
+}
+
+static long leval_stack_size(void) {
+  long size = leval_stack_limit();
+  long reserve = size / 8 > LEVAL_STACK_RESERVE ? size / 8 : LEVAL_STACK_RESERVE;
+  return size - reserve;
+}
+
+Lval* lval_alloc(void) {
+  // every allocation pays off a little of the pending frees
+  if (lval_defer_len) { lval_reclaim(LVAL_DEFER_STEP); }
+
+  if (!lval_free_list && __atomic_load_n(&lval_spare, __ATOMIC_RELAXED)) {
+    // a chunk's worth at most, other threads may run out as well
+    pthread_mutex_lock(&lval_spare_lock);
+    Lval* last = lval_spare;
+    for (int n = 1; last && last->next && n < LVAL_CHUNK; n++) { last = last->next; }
+    lval_free_list = lval_spare;
+    __atomic_store_n(&lval_spare, last ? last->next : NULL, __ATOMIC_RELAXED);
+    if (last) { last->next = NULL; }
+    pthread_mutex_unlock(&lval_spare_lock);
+    lthread_track();
+  }
+
+  if (!lval_free_list) {
+    lthread_track();
+    // carve a new chunk into free slots, neighbours stay adjacent in memory
+    Lval* chunk = malloc(sizeof(Lval) * LVAL_CHUNK);
+    for (int i = 0; i < LVAL_CHUNK - 1; i++) {
+      chunk[i].next = &chunk[i + 1];
+    }
+    chunk[LVAL_CHUNK - 1].next = NULL;
+    lval_free_list = chunk;
+  }
+
+  Lval* v = lval_free_list;
+  lval_free_list = v->next;
+  v->count = 0;
+  return v;
+}
+
+void lval_free(Lval* v) {
+  v->next = lval_free_list;
+  lval_free_list = v;
+}
+
+// release up to budget children of the queued lists
+void lval_reclaim(int budget) {
+  while (budget > 0 && lval_defer_len) {
+    Lval* v = lval_defer_queue[lval_defer_head];
+
+    // free from the tail, a long list may take several calls
+    while (budget > 0 && v->count) {
+      lval_del(v->cell[--v->count]);
+      budget--;
+    }
+    if (v->count) { break; }
+
+    free(v->cell);
+    lval_free(v);
+    lval_defer_head = (lval_defer_head + 1) % LVAL_DEFER_DEPTH;
+    lval_defer_len--;
+  }
+}
+
 // helper functions to create num / errors
-Lval* lval_num(int num) {
-  Lval* v = malloc(sizeof(Lval));
+Lval* lval_num(long num) {
+  Lval* v = lval_alloc();
   v->type = LVAL_NUM;
   v->num = num;
   return v;
@@ -27,14 +161,14 @@ Lval* lval_num(int num) {
 
 
 Lval* lval_bool(bool b) {
-  Lval* v = malloc(sizeof(Lval));
+  Lval* v = lval_alloc();
   v->type = LVAL_BOOL;
   v->num = b;
   return v;
 };
 
 Lval* lval_err(char* fmt, ...) {
-  Lval* v = malloc(sizeof(Lval));
+  Lval* v = lval_alloc();
   v->type = LVAL_ERR;
 
   va_list va;
@@ -47,16 +181,65 @@ Lval* lval_err(char* fmt, ...) {
   return v;
 };
 
+// FNV-1a
+unsigned long lsym_hash(char* s) {
+  unsigned long h = 14695981039346656037UL;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211UL;
+  }
+  return h;
+}
+
+// every symbol name ever read, open addressing on the name hash
+static char** lsym_table = NULL;
+static int lsym_count = 0;
+static int lsym_mask = -1;
+static pthread_mutex_t lsym_lock = PTHREAD_MUTEX_INITIALIZER;
+
+char* lsym_intern(char* s, unsigned long hash) {
+  pthread_mutex_lock(&lsym_lock);
+  if (lsym_count * 2 >= lsym_mask + 1) {
+    int size = lsym_table ? (lsym_mask + 1) * 2 : 256;
+    char** table = calloc(size, sizeof(char*));
+    for (int i = 0; i <= lsym_mask; i++) {
+      if (!lsym_table[i]) { continue; }
+      unsigned long j = lsym_hash(lsym_table[i]) & (size - 1);
+      while (table[j]) { j = (j + 1) & (size - 1); }
+      table[j] = lsym_table[i];
+    }
+    free(lsym_table);
+    lsym_table = table;
+    lsym_mask = size - 1;
+  }
+
+  unsigned long i = hash & lsym_mask;
+  for (; lsym_table[i]; i = (i + 1) & lsym_mask) {
+    if (strcmp(lsym_table[i], s) == 0) { break; }
+  }
+  if (!lsym_table[i]) {
+    lsym_table[i] = malloc(strlen(s) + 1);
+    strcpy(lsym_table[i], s);
+    lsym_count++;
+  }
+  char* sym = lsym_table[i];
+  pthread_mutex_unlock(&lsym_lock);
+  return sym;
+}
+
 Lval* lval_sym(char* s) {
-  Lval* v = malloc(sizeof(Lval));
+  Lval* v = lval_alloc();
   v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  v->hash = lsym_hash(s);
+  v->sym = lsym_intern(s, v->hash);
+  v->depth = 0;
+  v->slot = -1;
+  v->cache = NULL;
   return v;
 }
 
 Lval* lval_sexp(void) {
-  Lval* v = malloc(sizeof(Lval));
+  Lval* v = lval_alloc();
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
@@ -64,7 +247,7 @@ Lval* lval_sexp(void) {
 }
 
 Lval* lval_qexp(void) {
-  Lval* v = malloc(sizeof(Lval));
+  Lval* v = lval_alloc();
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
@@ -72,26 +255,74 @@ Lval* lval_qexp(void) {
 }
 
 Lval* lval_fun(Lbuildin func) {
-  Lval* v = malloc(sizeof(Lval));
+  Lval* v = lval_alloc();
   v->type = LVAL_FUN;
   v->buildin = func;
   return v;
 };
 
-Lval* lval_lambda(Lval* formals, Lval* body) {
-  Lval* v = malloc(sizeof(Lval));
+Lval* lval_lambda(Lval* formals, Lval* body, Lenv* env) {
+  Lval* v = lval_alloc();
   v->type = LVAL_FUN;
 
   v->buildin = NULL;
-  v->env = lenv_new();
-  v->formals = formals;
-  v->body = body;
+  v->fun = malloc(sizeof(Lfun));
+  v->fun->ref = 1;
+  v->fun->formals = formals;
+  v->fun->body = body;
+  v->fun->env = env;
+  v->fun->bloom = 0;
+  v->fun->base = NULL;
+  v->fun->args = NULL;
+  v->fun->code = NULL;
+  v->fun->node = NULL;
+  v->fun->linked = false;
+  v->fun->tier = LTIER_TREE;
+  v->fun->calls = 0;
+  v->fun->loops = 0;
+  v->fun->jit = NULL;
+  v->fun->opt = NULL;
+  v->fun->watched = false;
+  v->fun->seen = 0;
+  for (int i = 0; i < formals->count; i++) {
+    v->fun->bloom |= LENV_BLOOM(formals->cell[i]->hash);
+  }
 
   return v;
 }
 
-Lval* lval_copy(Lval* l) {
-  Lval* v = malloc(sizeof(Lval));
+// fn applied to the arguments in args, which it takes over
+Lval* lval_partial(Lfun* fn, Lval* args) {
+  Lval* v = lval_alloc();
+  v->type = LVAL_FUN;
+
+  v->buildin = NULL;
+  v->fun = malloc(sizeof(Lfun));
+  v->fun->ref = 1;
+  v->fun->formals = NULL;
+  v->fun->body = NULL;
+  v->fun->env = NULL;
+  v->fun->bloom = 0;
+  v->fun->base = fn;
+  v->fun->args = args;
+  v->fun->code = NULL;
+  v->fun->node = NULL;
+  v->fun->linked = false;
+  v->fun->tier = LTIER_TREE;
+  v->fun->calls = 0;
+  v->fun->loops = 0;
+  v->fun->jit = NULL;
+  v->fun->opt = NULL;
+  v->fun->watched = false;
+  v->fun->seen = 0;
+  LREF_INC(fn->ref);
+
+  return v;
+}
+
+// a copy of l, the cells of a list are left on the walk stack to copy
+static Lval* lval_copy_one(Lval* l) {
+  Lval* v = lval_alloc();
   v->type = l->type;
 
   switch (v->type) {
@@ -104,54 +335,118 @@ Lval* lval_copy(Lval* l) {
         v->buildin = l->buildin;
       } else {
         v->buildin = NULL;
-        v->env = lenv_copy(l->env);
-        v->formals = lval_copy(l->formals);
-        v->body = lval_copy(l->body);
+        v->fun = l->fun;
+        LREF_INC(v->fun->ref);
       }
       break;
     case LVAL_ERR:
       v->err = malloc(strlen(l->err) + 1); strcpy(v->err, l->err);
       break;
     case LVAL_SYM:
-      v->sym = malloc(strlen(l->sym) + 1); strcpy(v->sym, l->sym);
+      v->sym = l->sym;
+      v->hash = l->hash;
+      v->depth = l->depth;
+      v->slot = l->slot;
+      v->cache = l->cache;
+      if (v->cache) { LREF_INC(v->cache->ref); }
       break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       v->count = l->count;
       v->cell = malloc(sizeof(Lval*) * l->count);
-      for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_copy(l->cell[i]);
-      }
+      if (l->count) { lwalk_push(l, v, 0); }
       break;
   };
 
   return v;
 };
 
-void lval_del(Lval* v) {
+Lval* lval_copy(Lval* l) {
+  if (l->type != LVAL_SEXPR && l->type != LVAL_QEXPR) { return lval_copy_one(l); }
+
+  int base = lwalk_sp;
+  Lval* v = lval_copy_one(l);
+  while (lwalk_sp > base) {
+    Lwork x = lwalk_stack[--lwalk_sp];
+    for (int i = 0; i < x.v->count; i++) {
+      x.w->cell[i] = lval_copy_one(x.v->cell[i]);
+    }
+  }
+  return v;
+};
+
+static void lvm_free(Lcode* c);
+static void lnode_free(Lnode* n);
+static void ljit_free(Ljit* j);
+static void lopt_free(Lfun* fn);
+
+static void lfun_release(Lfun* fn) {
+  if (LREF_DEC(fn->ref) != 0) { return; }
+  if (fn->jit) { ljit_free(fn->jit); }
+  if (fn->opt) {
+    lopt_free(fn);
+  } else {
+    if (fn->code) { lvm_free(fn->code); }
+    if (fn->node) { lnode_free(fn->node); }
+  }
+  if (fn->base) {
+    lfun_release(fn->base);
+    lval_del(fn->args);
+  } else {
+    if (fn->env) { lenv_del(fn->env); }
+    lval_del(fn->formals);
+    lval_del(fn->body);
+  }
+  free(fn);
+}
+
+// release v, the cells of a list are left on the walk stack to release
+static void lval_release(Lval* v) {
   switch (v->type) {
     case LVAL_NUM:
     case LVAL_BOOL:
       break;
     case LVAL_FUN:
-      if (!v->buildin) {
-        lenv_del(v->env);
-        lval_del(v->formals);
-        lval_del(v->body);
-      }
+      if (!v->buildin) { lfun_release(v->fun); }
       break;
     case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
+    case LVAL_SYM:
+      if (v->cache && LREF_DEC(v->cache->ref) == 0) { free(v->cache); }
+      break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
+      if (LVAL_DEFER_FREE && v->count >= LVAL_DEFER_MIN
+          && lval_defer_len < LVAL_DEFER_DEPTH) {
+        lval_defer_queue[(lval_defer_head + lval_defer_len) % LVAL_DEFER_DEPTH] = v;
+        lval_defer_len++;
+        return;
+      }
       for (int i = 0; i < v->count; i++) {
-        lval_del(v->cell[i]);
+        Lval* x = v->cell[i];
+        if (x->type == LVAL_NUM || x->type == LVAL_BOOL) {
+          lval_free(x);
+        } else {
+          lwalk_push(x, NULL, 0);
+        }
       }
       free(v->cell);
       break;
   }
 
-  free(v);
+  lval_free(v);
+};
+
+void lval_del(Lval* v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) {
+    lval_release(v);
+    return;
+  }
+
+  int base = lwalk_sp;
+  lval_release(v);
+  while (lwalk_sp > base) {
+    lval_release(lwalk_stack[--lwalk_sp].v);
+  }
 };
 
 void lval_expr_print(Lval* v, char open, char close) {
@@ -170,61 +465,107 @@ void lval_expr_print(Lval* v, char open, char close) {
   fputc(close, out);
 }
 
-void lval_print(Lval* v) {
+// print v, a list only opens and leaves its cells on the walk stack
+static void lval_print_one(Lval* v) {
   FILE* out = DEBUG ? stderr : stdout;
   switch (v->type) {
     case LVAL_NUM: fprintf(out, "%li", v->num); break;
     case LVAL_BOOL: fprintf(out, "%s", v->num ? "<true>" : "<false>"); break;
     case LVAL_ERR: fprintf(out, "ERROR: %s", v->err); break;
     case LVAL_SYM: fprintf(out, "%s", v->sym); break;
-    case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      fputc(v->type == LVAL_SEXPR ? '(' : '{', out);
+      lwalk_push(v, NULL, 0);
+      break;
     case LVAL_FUN:
       if (v->buildin) {
         fprintf(out, "<build>");
       } else {
+        // a partial application shows the formals still to be bound
+        Lfun* fn = v->fun->base ? v->fun->base : v->fun;
+        int bound = v->fun->base ? v->fun->args->count : 0;
+        Lval rest = { .type = LVAL_QEXPR, .count = fn->formals->count - bound, .cell = fn->formals->cell + bound };
         fprintf(out, "(lambda ");
-        lval_print(v->formals);
+        lval_print(&rest);
         fputc(' ', out);
-        lval_print(v->body);
+        lval_print(fn->body);
         fputc(')', out);
       }
       break;
   }
 }
 
+void lval_print(Lval* v) {
+  FILE* out = DEBUG ? stderr : stdout;
+  int base = lwalk_sp;
+  lval_print_one(v);
+  while (lwalk_sp > base) {
+    Lwork* x = &lwalk_stack[lwalk_sp - 1];
+    if (x->i == x->v->count) {
+      fputc(x->v->type == LVAL_SEXPR ? ')' : '}', out);
+      lwalk_sp--;
+      continue;
+    }
+
+    // print spaces except before the first element
+    if (x->i > 0) { fputc(' ', out); }
+    lval_print_one(x->v->cell[x->i++]);
+  }
+}
+
 void lval_println(Lval* v) {
   FILE* out = DEBUG ? stderr : stdout;
   lval_print(v);
   fputc('\n', out);
 }
 
-int lval_eq(Lval* v, Lval* w) {
+// same lambda source, or partial applications of such to equal arguments
+static int lfun_eq(Lfun* a, Lfun* b) {
+  if (a == b) { return 1; }
+  if (!a->base != !b->base) { return 0; }
+  if (a->base) { return lfun_eq(a->base, b->base) && lval_eq(a->args, b->args); }
+  return lval_eq(a->formals, b->formals) && lval_eq(a->body, b->body);
+}
+
+// whether v and w match, the cells of two lists of the same length are
+// left on the walk stack to compare
+static int lval_eq_one(Lval* v, Lval* w) {
   if (v->type != w->type) { return 0; }
   switch (v->type) {
     case LVAL_NUM:
     case LVAL_BOOL:
       return (v->num == w->num);
-    case LVAL_ERR: return strcmp(v->err, w->err);
-    case LVAL_SYM: return strcmp(v->sym, w->sym);
+    case LVAL_ERR: return strcmp(v->err, w->err) == 0;
+    case LVAL_SYM: return v->sym == w->sym;
     case LVAL_FUN:
       if (v->buildin || w->buildin) {
         return (v->buildin == w->buildin);
       } else {
-        return lval_eq(v->formals, w->formals) && lval_eq(v->body, w->body);
+        return lfun_eq(v->fun, w->fun);
       }
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       if (v->count != w->count) { return 0; }
-      for (int i = 0; i < v->count; i++) {
-        if (!lval_eq(v->cell[i], w->cell[i])) { return 0; }
-        return 1;
-      }
-      break;
+      if (v->count) { lwalk_push(v, w, 0); }
+      return 1;
   }
   return 0; // default case
 }
 
+int lval_eq(Lval* v, Lval* w) {
+  int base = lwalk_sp;
+  int eq = lval_eq_one(v, w);
+  while (eq && lwalk_sp > base) {
+    Lwork x = lwalk_stack[--lwalk_sp];
+    for (int i = 0; eq && i < x.v->count; i++) {
+      eq = lval_eq_one(x.v->cell[i], x.w->cell[i]);
+    }
+  }
+  lwalk_sp = base;
+  return eq;
+}
+
 // add x to the sexp or qexp
 Lval* lval_add(Lval* v, Lval* x) {
   assert(v->type == LVAL_SEXPR || v->type == LVAL_QEXPR);
@@ -234,6 +575,38 @@ Lval* lval_add(Lval* v, Lval* x) {
   return v;
 };
 
+// the grammar, shared by the prompt and imported files
+static mpc_parser_t* Prog;
+static mpc_parser_t* Expr;
+static mpc_parser_t* Sexpr;
+static mpc_parser_t* Qexpr;
+static mpc_parser_t* Number;
+static mpc_parser_t* Symbol;
+
+void lval_parser_init(void) {
+  Prog = mpc_new("program");
+  Expr = mpc_new("expr");
+  Sexpr = mpc_new("sexpr");
+  Qexpr = mpc_new("qexpr");
+  Number = mpc_new("number");
+  Symbol = mpc_new("symbol");
+
+  mpca_lang(MPC_LANG_DEFAULT,
+      " \
+      symbol  : /[a-zA-Z0-9_+\\-*\\/%\\\\=<>!&\\|]+/; \
+      number  : /-?[0-9]+(\\.[0-9]+)?/; \
+      expr    : <number> | <symbol> | <sexpr> | <qexpr> ;\
+      sexpr   : '(' <expr>* ')';\
+      qexpr   : '{' <expr>* '}';\
+      program : /^/ <expr>* /$/;\
+      ",
+      Number, Symbol, Expr, Sexpr, Qexpr, Prog);
+}
+
+void lval_parser_cleanup(void) {
+  mpc_cleanup(6, Number, Symbol, Expr, Sexpr, Qexpr, Prog);
+}
+
 Lval* lval_read_num(mpc_ast_t* t) {
   long x = strtol(t->contents, NULL, 10);
   return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
@@ -265,19 +638,48 @@ Lval* lval_read(mpc_ast_t* t) {
   return x;
 };
 
-Lval* lval_eval_sexpr(Lenv* e, Lval* v) {
-  // replace children with evaluated result
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
-  }
+// Tail calls of the tree walker. lval_call sets ltail_pos before it
+// evaluates a body, the S-expression evaluated next takes it and passes it
+// on only to if and eval. A call there that saturates a lambda walked as a
+// tree is handed back to lval_call, which reuses the frame.
+static __thread bool ltail_pos;
+static __thread Lval* ltail_f;
+static __thread Lval* ltail_args;
+static Lval ltail_call = { .type = LVAL_SEXPR };
+
+static Lfun* lval_tail(Lval* f, int argn, int exec);
+
+static bool lval_tail_buildin(Lbuildin b) {
+  return b == buildin_if || b == buildin_eval;
+}
+
+// position of v's head in LBUILDINS plus one when it is linked, else 0
+static int lval_linked(Lval* v) {
+  return v->count > 1 && v->cell[0]->type == LVAL_SYM
+    && v->cell[0]->depth == LADDR_BUILDIN ? v->cell[0]->slot + 1 : 0;
+}
+
+// apply v, whose cells are evaluated
+static Lval* lval_apply(Lenv* e, Lval* v, bool tail) {
+  // a head linked to a builtin is called without looking it up
+  int linked = lval_linked(v);
 
   // propagate the errors
-  for (int i = 0; i < v->count; i++) {
+  for (int i = linked ? 1 : 0; i < v->count; i++) {
     if (v->cell[i]->type == LVAL_ERR) {
       return lval_take(v, i);
     }
   }
 
+  if (linked) {
+    lval_del(lval_pop(v, 0));
+    Lbuildin b = lbuildin_vals[linked - 1].buildin;
+    ltail_pos = tail && lval_tail_buildin(b);
+    Lval* r = b(e, v);
+    ltail_pos = false;
+    return r;
+  }
+
   if (v->count == 0) { return v; }
   if (v->count == 1) { return lval_take(v, 0); }
 
@@ -288,12 +690,53 @@ Lval* lval_eval_sexpr(Lenv* e, Lval* v) {
     return err;
   }
 
+  if (tail && lval_tail(f, v->count, LEXEC_TREE)) {
+    ltail_f = f;
+    ltail_args = v;
+    return &ltail_call;
+  }
+
   // apply the operation for the rest of list
+  ltail_pos = tail && f->buildin && lval_tail_buildin(f->buildin);
   Lval* result = lval_call(e, f, v);
+  ltail_pos = false;
   lval_del(f);
   return result;
 };
 
+// Nested S-expressions wait on the walk stack while their cells are
+// evaluated, so nesting takes no C stack
+Lval* lval_eval_sexpr(Lenv* e, Lval* v) {
+  bool tail = ltail_pos;
+  ltail_pos = false;
+
+  int base = lwalk_sp;
+  lwalk_push(v, NULL, lval_linked(v) ? 1 : 0);
+  for (;;) {
+    Lwork* x = &lwalk_stack[lwalk_sp - 1];
+
+    // replace children with evaluated result
+    if (x->i < x->v->count) {
+      Lval* c = x->v->cell[x->i];
+      if (c->type == LVAL_SEXPR) {
+        lwalk_push(c, NULL, lval_linked(c) ? 1 : 0);
+        continue;
+      }
+      c = lval_eval(e, c);
+      x = &lwalk_stack[lwalk_sp - 1];
+      x->v->cell[x->i++] = c;
+      continue;
+    }
+
+    Lval* y = x->v;
+    lwalk_sp--;
+    Lval* r = lval_apply(e, y, tail && lwalk_sp == base);
+    if (lwalk_sp == base) { return r; }
+    x = &lwalk_stack[lwalk_sp - 1];
+    x->v->cell[x->i++] = r;
+  }
+};
+
 Lval* lval_eval(Lenv* e, Lval* v) {
   if (v->type == LVAL_SYM) {
     Lval* x = lenv_get(e, v);
@@ -307,128 +750,2230 @@ Lval* lval_eval(Lenv* e, Lval* v) {
   return v;
 };
 
-Lval* lval_call(Lenv* e, Lval* f, Lval* l) {
+// the arguments of a call of fn, a partial application goes before
+// the ones it already holds
+static Lval* lfun_args(Lfun* fn, Lval* l) {
+  if (!fn->base) { return l; }
+
+  Lval* all = lval_sexp();
+  all->count = fn->args->count + l->count;
+  all->cell = malloc(sizeof(Lval*) * all->count);
+  for (int i = 0; i < fn->args->count; i++) {
+    all->cell[i] = lval_copy(fn->args->cell[i]);
+  }
+  memcpy(all->cell + fn->args->count, l->cell, sizeof(Lval*) * l->count);
+  l->count = 0;
+  lval_del(l);
+  return all;
+}
+
+// The frame of a call of fn takes argn entries off the call stack and the
+// arguments are moved into them, names are the interned formals. Returns
+// the stack pointer lenv_frame_pop restores.
+static int lenv_frame_push(Lenv* frame, Lenv* e, Lfun* fn, Lval* l) {
+  if (!lenv_stack) {
+    lthread_track();
+    lenv_stack = malloc(sizeof(Lentry) * LENV_STACK_MAX);
+  }
+  int argn = l->count;
+  int sp = lenv_sp;
+  *frame = (Lenv){ .count = argn, .cap = argn, .par = fn->env, .glob = e->glob, .stack = true, .bloom = fn->bloom };
+  if (lenv_sp + argn <= LENV_STACK_MAX) {
+    frame->entries = lenv_stack + lenv_sp;
+    lenv_sp += argn;
+  } else {
+    frame->entries = malloc(sizeof(Lentry) * argn);
+    frame->stack = false;
+  }
+
+  for (int i = 0; i < argn; i++) {
+    Lentry* x = &frame->entries[i];
+    x->sym = fn->formals->cell[i]->sym;
+    x->hash = fn->formals->cell[i]->hash;
+    x->version = 0;
+    x->val = l->cell[i];
+    x->status = false;
+  }
+  l->count = 0;
+  lval_del(l);
+  return sp;
+}
+
+static void lenv_frame_pop(Lenv* frame, int sp) {
+  for (int i = 0; i < frame->count; i++) {
+    lval_del(frame->entries[i].val);
+  }
+  if (!frame->stack) { free(frame->entries); }
+  free(frame->index);
+  lenv_sp = sp;
+}
+
+static Lval* lvm_run(Lenv* e, Lfun* fn, Lval* l);
+static Lval* lnode_run(Lenv* e, Lfun* fn, Lval* l);
+static Lval* ljit_run(Lenv* e, Lfun* fn, Lval* l);
+static void ltier_call(Lenv* e, Lfun* fn);
+static void ltier_loop(Lenv* e, Lfun* fn);
+static void ltype_seen(Lfun* fn, Lval* l);
+
+// Run a call of fn in the tier it reached. NULL leaves it, with l
+// untouched, to the tree walker.
+static Lval* ltier_run(Lenv* e, Lfun* fn, Lval* l) {
+  int tier = __atomic_load_n(&fn->tier, __ATOMIC_ACQUIRE);
+  if (tier == LTIER_JIT) {
+    Lval* r = ljit_run(e, fn, l);
+    if (r) { return r; }
+  }
+  if (tier == LTIER_TREE) { return NULL; }
+  if (fn->code) { return lvm_run(e, fn, l); }
+  if (fn->node) { return lnode_run(e, fn, l); }
+  return NULL;
+}
+
+static Lval* lval_enter(Lenv* e, Lval* f, Lval* l) {
   if (f->buildin) { return f->buildin(e, l); }
 
-  int formaln = f->formals->count;
+  l = lfun_args(f->fun, l);
+  Lfun* fn = f->fun->base ? f->fun->base : f->fun;
+  int formaln = fn->formals->count;
   int argn = l->count;
 
-  while(l->count) {
-    if (f->formals->count == 0) {
-      lval_del(l);
-      return lval_err("Too many arguments, expect %s, Got %s", formaln, argn);
+  if (argn > formaln) {
+    lval_del(l);
+    return lval_err("Too many arguments, expect %d, Got %d", formaln, argn);
+  }
+
+  // too few arguments, hold on to them until the rest arrive
+  if (argn < formaln) { return lval_partial(fn, l); }
+
+  ltier_call(e, fn);
+  ltype_seen(fn, l);
+  Lval* r = ltier_run(e, fn, l);
+  if (r) { return r; }
+
+  Lenv frame;
+  int sp = lenv_frame_push(&frame, e, fn, l);
+  Lval* self = NULL;
+
+  for (;;) {
+    ltail_pos = true;
+    r = buildin_eval(&frame, lval_add(lval_sexp(), lval_copy(fn->body)));
+    if (r != &ltail_call) { break; }
+
+    // the frame is left before the next one is entered in its place
+    Lval* a = lfun_args(ltail_f->fun, ltail_args);
+    lenv_frame_pop(&frame, sp);
+    if (self) { lval_del(self); }
+    self = ltail_f;
+    Lfun* g = self->fun->base ? self->fun->base : self->fun;
+    if (g == fn) { ltier_loop(e, g); } else { ltier_call(e, g); }
+    ltype_seen(g, a);
+    fn = g;
+
+    // a loop that got hot goes on in the tier it was promoted to
+    r = ltier_run(e, fn, a);
+    if (r) {
+      lval_del(self);
+      return r;
     }
+    sp = lenv_frame_push(&frame, e, fn, a);
+  }
 
-    Lval* sym = lval_pop(f->formals, 0);
-    Lval* val = lval_pop(l, 0);
+  lenv_frame_pop(&frame, sp);
+  if (self) { lval_del(self); }
+  return r;
+};
 
-    lenv_put(f->env, sym, val, 0);
+Lval* lval_call(Lenv* e, Lval* f, Lval* l) {
+  char here;
+  if (leval_depth == 0) {
+    leval_stack_base = &here;
+    if (!leval_stack_budget) { leval_stack_budget = leval_stack_size(); }
+  }
+  if (leval_depth >= LEVAL_DEPTH_MAX) {
+    lval_del(l);
+    return lval_err("Calls nested deeper than %d", LEVAL_DEPTH_MAX);
+  }
+  if (leval_stack_base - &here > leval_stack_budget) {
+    lval_del(l);
+    return lval_err("Calls nested deeper than the C stack allows");
+  }
+  leval_depth++;
+  Lval* r = lval_enter(e, f, l);
+  leval_depth--;
+  return r;
+};
 
-    lval_del(sym);
-    lval_del(val);
+// Check a call of f with arguments a, both evaluated: an error among
+// them or a head that is no function is the call's result and both are
+// released. NULL when the call can go ahead.
+static Lval* lval_callable(Lval* f, Lval* a) {
+  Lval* x = NULL;
+  if (f->type == LVAL_ERR) {
+    x = f; f = NULL;
+  } else if (a->type == LVAL_ERR) {
+    x = a; a = NULL;
+  } else if (f->type != LVAL_FUN) {
+    x = lval_err("Expect the first element to be a %s, Got %s", ltype_name(LVAL_FUN), ltype_name(f->type));
+  } else {
+    return NULL;
   }
+  if (f) { lval_del(f); }
+  if (a) { lval_del(a); }
+  return x;
+}
 
-  lval_del(l);
+// whether a call of f with argn arguments can reuse the caller's frame,
+// it has to saturate a lambda run by the same backend, exec
+static Lfun* lval_tail(Lval* f, int argn, int exec) {
+  if (f->buildin) { return NULL; }
+  Lfun* g = f->fun->base ? f->fun->base : f->fun;
+  argn += f->fun->base ? f->fun->args->count : 0;
+  int by = __atomic_load_n(&g->tier, __ATOMIC_ACQUIRE) == LTIER_TREE ? LEXEC_TREE
+      : g->code ? LEXEC_VM : g->node ? LEXEC_CLOSURE : LEXEC_TREE;
+  if (argn != g->formals->count || by != exec) { return NULL; }
+  return g;
+}
+
+// the VM stack, values on it are owned by it
+static __thread Lval** lvm_stack = NULL;
+static __thread int lvm_sp = 0;
+
+// the empty S-expression a body like {} evaluates to
+static Lval lvm_nil = { .type = LVAL_SEXPR };
+
+static void lvm_emit(Lcode* c, int op) {
+  if (c->count == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 16;
+    c->ops = realloc(c->ops, sizeof(int) * c->cap);
+  }
+  c->ops[c->count++] = op;
+}
+
+static int lvm_const(Lcode* c, Lval* v) {
+  c->consts = realloc(c->consts, sizeof(Lval*) * (c->nconst + 1));
+  c->consts[c->nconst] = v;
+  return c->nconst++;
+}
+
+static void lvm_height(Lcode* c, int n) {
+  c->height += n;
+  if (c->height > c->depth) { c->depth = c->height; }
+}
+
+// the op for a builtin on two numbers, -1 if it has none
+static int lvm_binop(Lbuildin b) {
+  if (b == buildin_add) { return LOP_ADD; }
+  if (b == buildin_sub) { return LOP_SUB; }
+  if (b == buildin_mul) { return LOP_MUL; }
+  if (b == buildin_div) { return LOP_DIV; }
+  if (b == buildin_mod) { return LOP_MOD; }
+  if (b == buildin_lt) { return LOP_LT; }
+  if (b == buildin_lteq) { return LOP_LE; }
+  if (b == buildin_gt) { return LOP_GT; }
+  if (b == buildin_gteq) { return LOP_GE; }
+  if (b == buildin_eq) { return LOP_EQ; }
+  if (b == buildin_neq) { return LOP_NE; }
+  return -1;
+}
+
+static void lvm_list(Lcode* c, Lval* v, bool tail);
+
+// code leaving the value of v on the stack
+static void lvm_expr(Lcode* c, Lval* v, bool tail) {
+  if (v->type == LVAL_SEXPR) {
+    lvm_list(c, v, tail);
+    return;
+  }
 
-  // partially bound function
-  if (f->formals->count) {
-    return lval_copy(f);
+  if (v->type != LVAL_SYM) {
+    lvm_emit(c, LOP_CONST);
+    lvm_emit(c, lvm_const(c, v));
+  } else if (v->depth == 0 && v->slot >= 0) {
+    lvm_emit(c, LOP_LOCAL);
+    lvm_emit(c, v->slot);
+  } else if (v->depth == 1 && v->slot >= 0) {
+    lvm_emit(c, LOP_CAPTURE);
+    lvm_emit(c, v->slot);
+  } else if (v->depth == LADDR_BUILDIN) {
+    lvm_emit(c, LOP_CONST);
+    lvm_emit(c, lvm_const(c, &lbuildin_vals[v->slot]));
   } else {
-    f->env->par = e;
-    return buildin_eval(f->env, lval_add(lval_sexp(), lval_copy(f->body)));
+    lvm_emit(c, LOP_GLOBAL);
+    lvm_emit(c, lvm_const(c, v));
   }
-};
+  lvm_height(c, 1);
+}
 
-// take at the child out of v at index i
-Lval* lval_take(Lval* v, int i) {
-  Lval* x = lval_pop(v, i);
-  lval_del(v);
-  return x;
-};
+// code leaving the value of v's cells evaluated as an S-expression
+static void lvm_list(Lcode* c, Lval* v, bool tail) {
+  if (v->count == 0) {
+    lvm_emit(c, LOP_CONST);
+    lvm_emit(c, lvm_const(c, &lvm_nil));
+    lvm_height(c, 1);
+    return;
+  }
+  if (v->count == 1) {
+    lvm_expr(c, v->cell[0], tail);
+    return;
+  }
 
-// pop the child at index i
-Lval* lval_pop(Lval* v, int i) {
-  // hold that variable
-  Lval* x = v->cell[i];
+  Lval* h = v->cell[0];
+  Lbuildin b = h->type == LVAL_SYM && h->depth == LADDR_BUILDIN ? lbuildin_vals[h->slot].buildin : NULL;
+
+  // (if cond {then} {else}) jumps between its branches, an empty one is
+  // an error left to the builtin
+  if (b == buildin_if && v->count == 4
+      && v->cell[2]->type == LVAL_QEXPR && v->cell[2]->count
+      && v->cell[3]->type == LVAL_QEXPR && v->cell[3]->count) {
+    lvm_expr(c, v->cell[1], false);
+    lvm_emit(c, LOP_JUMPF);
+    int jumpf = c->count;
+    lvm_emit(c, 0);
+    lvm_emit(c, 0);
+    c->height--;
+
+    lvm_list(c, v->cell[2], tail);
+    c->height--;
+    lvm_emit(c, LOP_JUMP);
+    int jump = c->count;
+    lvm_emit(c, 0);
+
+    c->ops[jumpf] = c->count;
+    lvm_list(c, v->cell[3], tail);
+    c->ops[jumpf + 1] = c->count;
+    c->ops[jump] = c->count;
+    return;
+  }
 
-  // shift the after array over
-  memmove(&v->cell[i], &v->cell[i + 1], sizeof(Lval*) * (v->count - i - 1));
+  if (b && v->count == 3 && lvm_binop(b) >= 0) {
+    lvm_expr(c, v->cell[1], false);
+    lvm_expr(c, v->cell[2], false);
+    lvm_emit(c, lvm_binop(b));
+    lvm_emit(c, h->slot);
+    c->height--;
+    return;
+  }
 
-  // reduce the count
-  v->count--;
-  v->cell = realloc(v->cell, sizeof(Lval*) * (v->count));
+  for (int i = b ? 1 : 0; i < v->count; i++) {
+    lvm_expr(c, v->cell[i], false);
+  }
+  if (b) {
+    lvm_emit(c, LOP_BUILDIN);
+    lvm_emit(c, h->slot);
+  } else {
+    lvm_emit(c, tail ? LOP_TAILCALL : LOP_CALL);
+  }
+  lvm_emit(c, v->count - 1);
+  c->height -= b ? v->count - 2 : v->count - 1;
+}
 
-  return x;
-};
+// compile a resolved and linked lambda body
+Lcode* lvm_compile(Lval* body) {
+  Lcode* c = calloc(1, sizeof(Lcode));
+  lvm_list(c, body, true);
+  lvm_emit(c, LOP_RETURN);
+  return c;
+}
 
-// insert the child at index i
-Lval* lval_insert(Lval* v, Lval* a, int i) {
-  assert(v->type == LVAL_SEXPR || v->type == LVAL_QEXPR);
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(Lval*) * v->count);
-  // move for the position of new element
-  memmove(&v->cell[i + 1], &v->cell[i], sizeof(Lval*) * (v->count - i - 1));
+static void lvm_free(Lcode* c) {
+  free(c->ops);
+  free(c->consts);
+  free(c);
+}
 
-  v->cell[i] = a;
-  return v;
+// the top n values as an S-expression, or the first error among them
+static Lval* lvm_pop(int n) {
+  lvm_sp -= n;
+  Lval* l = lval_sexp();
+  l->count = n;
+  l->cell = malloc(sizeof(Lval*) * n);
+  memcpy(l->cell, lvm_stack + lvm_sp, sizeof(Lval*) * n);
+  for (int i = 0; i < n; i++) {
+    if (l->cell[i]->type == LVAL_ERR) { return lval_take(l, i); }
+  }
+  return l;
+}
+
+// x op y into x for two numbers, false when the builtin has to decide:
+// on overflow or division by zero, x is then left as it is
+static bool lvm_arith(int op, Lval* x, Lval* y) {
+  long r;
+  switch (op) {
+    case LOP_ADD: if (__builtin_add_overflow(x->num, y->num, &r)) { return false; } x->num = r; return true;
+    case LOP_SUB: if (__builtin_sub_overflow(x->num, y->num, &r)) { return false; } x->num = r; return true;
+    case LOP_MUL: if (__builtin_mul_overflow(x->num, y->num, &r)) { return false; } x->num = r; return true;
+    case LOP_DIV:
+      if (!y->num || (y->num == -1 && x->num == LONG_MIN)) { return false; }
+      x->num /= y->num;
+      return true;
+    case LOP_MOD:
+      if (!y->num) { return false; }
+      x->num = y->num == -1 ? 0 : x->num % y->num;
+      return true;
+    case LOP_LT: x->num = x->num < y->num; return true;
+    case LOP_LE: x->num = x->num <= y->num; return true;
+    case LOP_GT: x->num = x->num > y->num; return true;
+    case LOP_GE: x->num = x->num >= y->num; return true;
+    case LOP_EQ: x->num = x->num == y->num; return true;
+    case LOP_NE: x->num = x->num != y->num; return true;
+    case LOP_AND: x->num = x->num && y->num; return true;
+    case LOP_OR: x->num = x->num || y->num; return true;
+  }
+  return false;
+}
+
+// Run a call of fn on its frame. Values and errors flow as they do in
+// the tree walker: every argument is evaluated and the first error wins.
+// A tail call of a compiled lambda with all its arguments reuses the
+// frame, self then holds the function being run.
+static Lval* lvm_run(Lenv* e, Lfun* fn, Lval* l) {
+  if (!lvm_stack) {
+    lthread_track();
+    lvm_stack = malloc(sizeof(Lval*) * LVM_STACK_MAX);
+  }
+
+  Lenv frame;
+  int sp = lenv_frame_push(&frame, e, fn, l);
+  Lval* self = NULL;
+  Lcode* c = fn->code;
+  int pc = 0;
+  Lval* r = NULL;
+
+  while (!r) {
+    if (pc == 0 && lvm_sp + c->depth > LVM_STACK_MAX) {
+      r = lval_err("VM stack exhausted");
+      break;
+    }
+
+    int op = c->ops[pc++];
+    switch (op) {
+      case LOP_CONST:
+        lvm_stack[lvm_sp++] = lval_copy(c->consts[c->ops[pc++]]);
+        break;
+      case LOP_LOCAL:
+        lvm_stack[lvm_sp++] = lval_copy(frame.entries[c->ops[pc++]].val);
+        break;
+      case LOP_CAPTURE:
+        lvm_stack[lvm_sp++] = lval_copy(fn->env->entries[c->ops[pc++]].val);
+        break;
+      case LOP_GLOBAL:
+        lvm_stack[lvm_sp++] = lenv_get(&frame, c->consts[c->ops[pc++]]);
+        break;
+      case LOP_BUILDIN: {
+        int b = c->ops[pc++];
+        Lval* a = lvm_pop(c->ops[pc++]);
+        lvm_stack[lvm_sp++] = a->type == LVAL_ERR ? a : lbuildin_vals[b].buildin(&frame, a);
+        break;
+      }
+      case LOP_CALL:
+      case LOP_TAILCALL: {
+        Lval* a = lvm_pop(c->ops[pc++]);
+        Lval* f = lvm_stack[--lvm_sp];
+        Lval* x = lval_callable(f, a);
+        if (x) {
+          lvm_stack[lvm_sp++] = x;
+          break;
+        }
+
+        Lfun* g = op == LOP_TAILCALL ? lval_tail(f, a->count, LEXEC_VM) : NULL;
+        if (!g) {
+          lvm_stack[lvm_sp++] = lval_call(&frame, f, a);
+          lval_del(f);
+          break;
+        }
+
+        // the frame is left before the next one is entered in its place
+        a = lfun_args(f->fun, a);
+        lenv_frame_pop(&frame, sp);
+        if (self) { lval_del(self); }
+        self = f;
+        if (g == fn) { ltier_loop(e, g); } else { ltier_call(e, g); }
+        fn = g;
+        c = fn->code;
+        sp = lenv_frame_push(&frame, e, fn, a);
+        pc = 0;
+        break;
+      }
+      case LOP_JUMPF: {
+        Lval* x = lvm_stack[--lvm_sp];
+        int to = c->ops[pc++];
+        int end = c->ops[pc++];
+        if (x->type == LVAL_ERR) {
+          lvm_stack[lvm_sp++] = x;
+          pc = end;
+        } else if (x->type != LVAL_NUM && x->type != LVAL_BOOL) {
+          lvm_stack[lvm_sp++] = lval_err("Function %s is passed in wrong type of arguments at %d. Expect %s or %s, Got %s",
+              "if", 0, ltype_name(LVAL_NUM), ltype_name(LVAL_BOOL), ltype_name(x->type));
+          lval_del(x);
+          pc = end;
+        } else {
+          if (!x->num) { pc = to; }
+          lval_del(x);
+        }
+        break;
+      }
+      case LOP_JUMP:
+        pc = c->ops[pc];
+        break;
+      case LOP_RETURN:
+        r = lvm_stack[--lvm_sp];
+        break;
+      default: {
+        int b = c->ops[pc++];
+        Lval* x = lvm_stack[lvm_sp - 2];
+        Lval* y = lvm_stack[lvm_sp - 1];
+        if (x->type == LVAL_NUM && y->type == LVAL_NUM && lvm_arith(op, x, y)) {
+          lval_del(y);
+          lvm_sp--;
+          break;
+        }
+        Lval* a = lvm_pop(2);
+        lvm_stack[lvm_sp++] = a->type == LVAL_ERR ? a : lbuildin_vals[b].buildin(&frame, a);
+        break;
+      }
+    }
+  }
+
+  lenv_frame_pop(&frame, sp);
+  if (self) { lval_del(self); }
+  return r;
+}
+
+static Lnode* lnode_new(Lexec exec, int count) {
+  Lnode* n = calloc(1, sizeof(Lnode));
+  n->exec = exec;
+  n->count = count;
+  n->kids = count ? malloc(sizeof(Lnode*) * count) : NULL;
+  return n;
+}
+
+static void lnode_free(Lnode* n) {
+  for (int i = 0; i < n->count; i++) { lnode_free(n->kids[i]); }
+  free(n->kids);
+  free(n);
+}
+
+#define LNODE_RUN(n, e) ((n)->exec((n), (e)))
+
+static Lval* lnode_const(Lnode* n, Lenv* e) { return lval_copy(n->val); }
+static Lval* lnode_local(Lnode* n, Lenv* e) { return lval_copy(e->entries[n->slot].val); }
+static Lval* lnode_capture(Lnode* n, Lenv* e) { return lval_copy(e->par->entries[n->slot].val); }
+static Lval* lnode_global(Lnode* n, Lenv* e) { return lenv_get(e, n->val); }
+
+// the kids from on evaluated as a list, or the first error among them
+static Lval* lnode_args(Lnode* n, int from, Lenv* e) {
+  Lval* l = lval_sexp();
+  l->count = n->count - from;
+  l->cell = malloc(sizeof(Lval*) * l->count);
+  for (int i = 0; i < l->count; i++) {
+    l->cell[i] = LNODE_RUN(n->kids[from + i], e);
+  }
+  for (int i = 0; i < l->count; i++) {
+    if (l->cell[i]->type == LVAL_ERR) { return lval_take(l, i); }
+  }
+  return l;
+}
+
+static Lval* lnode_buildin(Lnode* n, Lenv* e) {
+  Lval* a = lnode_args(n, 0, e);
+  return a->type == LVAL_ERR ? a : lbuildin_vals[n->slot].buildin(e, a);
+}
+
+static Lval* lnode_if(Lnode* n, Lenv* e) {
+  Lval* x = LNODE_RUN(n->kids[0], e);
+  if (x->type == LVAL_ERR) { return x; }
+  if (x->type != LVAL_NUM && x->type != LVAL_BOOL) {
+    Lval* err = lval_err("Function %s is passed in wrong type of arguments at %d. Expect %s or %s, Got %s",
+        "if", 0, ltype_name(LVAL_NUM), ltype_name(LVAL_BOOL), ltype_name(x->type));
+    lval_del(x);
+    return err;
+  }
+  Lnode* branch = n->kids[x->num ? 1 : 2];
+  lval_del(x);
+  return LNODE_RUN(branch, e);
+}
+
+// the condition is a number or a boolean
+static Lval* lnode_if_t(Lnode* n, Lenv* e) {
+  Lval* x = LNODE_RUN(n->kids[0], e);
+  Lnode* branch = n->kids[x->num ? 1 : 2];
+  lval_del(x);
+  return LNODE_RUN(branch, e);
+}
+
+// kids[0] runs when the formals have the types in slot, two bits each as
+// for lnode_compile, kids[1] compiled for any types otherwise
+static Lval* lnode_guard(Lnode* n, Lenv* e) {
+  unsigned types = n->slot;
+  for (int i = 0; types; i++, types >>= 2) {
+    int t = types & 3;
+    if (t && e->entries[i].val->type != (t == 1 ? LVAL_NUM : LVAL_QEXPR)) {
+      return LNODE_RUN(n->kids[1], e);
+    }
+  }
+  return LNODE_RUN(n->kids[0], e);
+}
+
+static Lval* lnode_call(Lnode* n, Lenv* e) {
+  Lval* f = LNODE_RUN(n->kids[0], e);
+  Lval* a = lnode_args(n, 1, e);
+  Lval* x = lval_callable(f, a);
+  if (x) { return x; }
+  x = lval_call(e, f, a);
+  lval_del(f);
+  return x;
+}
+
+// A tail call that saturates a compiled lambda hands it and its arguments
+// to lnode_run, which reuses the frame
+static __thread Lval* lnode_tail_f;
+static __thread Lval* lnode_tail_args;
+static Lval lnode_tail = { .type = LVAL_SEXPR };
+
+static Lval* lnode_tailcall(Lnode* n, Lenv* e) {
+  Lval* f = LNODE_RUN(n->kids[0], e);
+  Lval* a = lnode_args(n, 1, e);
+  Lval* x = lval_callable(f, a);
+  if (x) { return x; }
+  if (!lval_tail(f, a->count, LEXEC_CLOSURE)) {
+    x = lval_call(e, f, a);
+    lval_del(f);
+    return x;
+  }
+  lnode_tail_f = f;
+  lnode_tail_args = a;
+  return &lnode_tail;
+}
+
+// two numbers, otherwise builtin slot decides
+#define LNODE_BINOP(name, op) \
+  static Lval* name(Lnode* n, Lenv* e) { \
+    Lval* x = LNODE_RUN(n->kids[0], e); \
+    Lval* y = LNODE_RUN(n->kids[1], e); \
+    if (x->type == LVAL_NUM && y->type == LVAL_NUM && lvm_arith(op, x, y)) { \
+      lval_del(y); \
+      return x; \
+    } \
+    Lval* a = lval_add(lval_add(lval_sexp(), x), y); \
+    if (x->type == LVAL_ERR) { return lval_take(a, 0); } \
+    if (y->type == LVAL_ERR) { return lval_take(a, 1); } \
+    return lbuildin_vals[n->slot].buildin(e, a); \
+  }
+LNODE_BINOP(lnode_add, LOP_ADD)
+LNODE_BINOP(lnode_sub, LOP_SUB)
+LNODE_BINOP(lnode_mul, LOP_MUL)
+LNODE_BINOP(lnode_div, LOP_DIV)
+LNODE_BINOP(lnode_mod, LOP_MOD)
+LNODE_BINOP(lnode_lt, LOP_LT)
+LNODE_BINOP(lnode_le, LOP_LE)
+LNODE_BINOP(lnode_gt, LOP_GT)
+LNODE_BINOP(lnode_ge, LOP_GE)
+LNODE_BINOP(lnode_eq, LOP_EQ)
+LNODE_BINOP(lnode_ne, LOP_NE)
+
+static Lexec lnode_binops[] = {
+  [LOP_ADD] = lnode_add, [LOP_SUB] = lnode_sub, [LOP_MUL] = lnode_mul,
+  [LOP_DIV] = lnode_div, [LOP_MOD] = lnode_mod, [LOP_LT] = lnode_lt,
+  [LOP_LE] = lnode_le, [LOP_GT] = lnode_gt, [LOP_GE] = lnode_ge,
+  [LOP_EQ] = lnode_eq, [LOP_NE] = lnode_ne
+};
+
+// Unchecked: the kids are proven to be numbers or Q-expressions, only
+// what their values can still get wrong, like a division by zero or an
+// empty list, goes to the builtin for its error
+#define LNODE_BINOP_T(name, op) \
+  static Lval* name(Lnode* n, Lenv* e) { \
+    Lval* x = LNODE_RUN(n->kids[0], e); \
+    Lval* y = LNODE_RUN(n->kids[1], e); \
+    if (lvm_arith(op, x, y)) { \
+      lval_del(y); \
+      return x; \
+    } \
+    return lbuildin_vals[n->slot].buildin(e, lval_add(lval_add(lval_sexp(), x), y)); \
+  }
+LNODE_BINOP_T(lnode_add_t, LOP_ADD)
+LNODE_BINOP_T(lnode_sub_t, LOP_SUB)
+LNODE_BINOP_T(lnode_mul_t, LOP_MUL)
+LNODE_BINOP_T(lnode_div_t, LOP_DIV)
+LNODE_BINOP_T(lnode_mod_t, LOP_MOD)
+LNODE_BINOP_T(lnode_lt_t, LOP_LT)
+LNODE_BINOP_T(lnode_le_t, LOP_LE)
+LNODE_BINOP_T(lnode_gt_t, LOP_GT)
+LNODE_BINOP_T(lnode_ge_t, LOP_GE)
+LNODE_BINOP_T(lnode_eq_t, LOP_EQ)
+LNODE_BINOP_T(lnode_ne_t, LOP_NE)
+
+static Lexec lnode_binops_t[] = {
+  [LOP_ADD] = lnode_add_t, [LOP_SUB] = lnode_sub_t, [LOP_MUL] = lnode_mul_t,
+  [LOP_DIV] = lnode_div_t, [LOP_MOD] = lnode_mod_t, [LOP_LT] = lnode_lt_t,
+  [LOP_LE] = lnode_le_t, [LOP_GT] = lnode_gt_t, [LOP_GE] = lnode_ge_t,
+  [LOP_EQ] = lnode_eq_t, [LOP_NE] = lnode_ne_t
+};
+
+// + - and * of more than two numbers
+#define LNODE_FOLD_T(name, op) \
+  static Lval* name(Lnode* n, Lenv* e) { \
+    Lval* x = LNODE_RUN(n->kids[0], e); \
+    for (int i = 1; i < n->count; i++) { \
+      Lval* y = LNODE_RUN(n->kids[i], e); \
+      if (!lvm_arith(op, x, y)) { \
+        Lval* a = lval_add(lval_add(lval_sexp(), x), y); \
+        while (++i < n->count) { lval_add(a, LNODE_RUN(n->kids[i], e)); } \
+        return lbuildin_vals[n->slot].buildin(e, a); \
+      } \
+      lval_del(y); \
+    } \
+    return x; \
+  }
+LNODE_FOLD_T(lnode_addn_t, LOP_ADD)
+LNODE_FOLD_T(lnode_subn_t, LOP_SUB)
+LNODE_FOLD_T(lnode_muln_t, LOP_MUL)
+
+static Lexec lnode_folds_t[] = {
+  [LOP_ADD] = lnode_addn_t, [LOP_SUB] = lnode_subn_t, [LOP_MUL] = lnode_muln_t
+};
+
+static Lval* lnode_len_t(Lnode* n, Lenv* e) {
+  Lval* x = LNODE_RUN(n->kids[0], e);
+  int len = x->count;
+  lval_del(x);
+  return lval_num(len);
+}
+
+static Lval* lnode_head_t(Lnode* n, Lenv* e) {
+  Lval* x = LNODE_RUN(n->kids[0], e);
+  if (!x->count) { return lbuildin_vals[n->slot].buildin(e, lval_add(lval_sexp(), x)); }
+  while (x->count > 1) { lval_del(lval_pop(x, 1)); }
+  return x;
+}
+
+static Lval* lnode_tail_t(Lnode* n, Lenv* e) {
+  Lval* x = LNODE_RUN(n->kids[0], e);
+  if (!x->count) { return lbuildin_vals[n->slot].buildin(e, lval_add(lval_sexp(), x)); }
+  lval_del(lval_pop(x, 0));
+  return x;
+}
+
+static Lval* lnode_join_t(Lnode* n, Lenv* e) {
+  Lval* x = LNODE_RUN(n->kids[0], e);
+  for (int i = 1; i < n->count; i++) {
+    lval_join(x, LNODE_RUN(n->kids[i], e));
+  }
+  return x;
+}
+
+// unchecked nodes made by the compile under way
+static __thread int lnode_unchecked;
+
+static int lnode_type_list(Lval* v, unsigned types);
+
+// The type v surely evaluates to, never an error, or -1 when it is not
+// known. types are those of the formals as for lnode_compile.
+static int lnode_type(Lval* v, unsigned types) {
+  if (v->type == LVAL_SEXPR) { return lnode_type_list(v, types); }
+  if (v->type == LVAL_SYM) {
+    int t = v->depth == 0 && v->slot >= 0 && v->slot < LTYPE_FORMALS ? types >> (2 * v->slot) & 3 : 0;
+    return t == 1 ? LVAL_NUM : t == 2 ? LVAL_QEXPR : -1;
+  }
+  return v->type == LVAL_NUM || v->type == LVAL_BOOL || v->type == LVAL_QEXPR ? v->type : -1;
+}
+
+// the arguments of the call v are all of type t, or of some type for -1
+static bool lnode_args_are(Lval* v, unsigned types, int t) {
+  for (int i = 1; i < v->count; i++) {
+    int x = lnode_type(v->cell[i], types);
+    if (x < 0 || (t >= 0 && x != t)) { return false; }
+  }
+  return true;
+}
+
+// the same for v's cells evaluated as an S-expression, as lnode_list
+// compiles them
+static int lnode_type_list(Lval* v, unsigned types) {
+  if (v->count == 0) { return -1; }
+  if (v->count == 1) { return lnode_type(v->cell[0], types); }
+
+  Lval* h = v->cell[0];
+  Lbuildin b = h->type == LVAL_SYM && h->depth == LADDR_BUILDIN ? lbuildin_vals[h->slot].buildin : NULL;
+  if (!b) { return -1; }
+
+  if (b == buildin_if && v->count == 4
+      && v->cell[2]->type == LVAL_QEXPR && v->cell[2]->count
+      && v->cell[3]->type == LVAL_QEXPR && v->cell[3]->count) {
+    int c = lnode_type(v->cell[1], types);
+    int t = lnode_type_list(v->cell[2], types);
+    return (c == LVAL_NUM || c == LVAL_BOOL) && t == lnode_type_list(v->cell[3], types) ? t : -1;
+  }
+
+  // arithmetic may overflow, comparisons cannot fail
+  int op = lvm_binop(b);
+  if (op >= LOP_LT && v->count == 3 && lnode_args_are(v, types, LVAL_NUM)) { return LVAL_NUM; }
+  if (b == buildin_list && lnode_args_are(v, types, -1)) { return LVAL_QEXPR; }
+  if (b == buildin_len && v->count == 2 && lnode_args_are(v, types, LVAL_QEXPR)) { return LVAL_NUM; }
+  if (b == buildin_join && lnode_args_are(v, types, LVAL_QEXPR)) { return LVAL_QEXPR; }
+  return -1;
+}
+
+static Lnode* lnode_list(Lval* v, bool tail, unsigned types);
+
+// the node computing the value of v, same choices as lvm_expr
+static Lnode* lnode_expr(Lval* v, bool tail, unsigned types) {
+  if (v->type == LVAL_SEXPR) { return lnode_list(v, tail, types); }
+
+  Lnode* n;
+  if (v->type != LVAL_SYM) {
+    n = lnode_new(lnode_const, 0);
+    n->val = v;
+  } else if (v->depth == 0 && v->slot >= 0) {
+    n = lnode_new(lnode_local, 0);
+    n->slot = v->slot;
+  } else if (v->depth == 1 && v->slot >= 0) {
+    n = lnode_new(lnode_capture, 0);
+    n->slot = v->slot;
+  } else if (v->depth == LADDR_BUILDIN) {
+    n = lnode_new(lnode_const, 0);
+    n->val = &lbuildin_vals[v->slot];
+  } else {
+    n = lnode_new(lnode_global, 0);
+    n->val = v;
+  }
+  return n;
+}
+
+// the node computing v's cells evaluated as an S-expression
+static Lnode* lnode_list(Lval* v, bool tail, unsigned types) {
+  if (v->count == 0) {
+    Lnode* n = lnode_new(lnode_const, 0);
+    n->val = &lvm_nil;
+    return n;
+  }
+  if (v->count == 1) { return lnode_expr(v->cell[0], tail, types); }
+
+  Lval* h = v->cell[0];
+  Lbuildin b = h->type == LVAL_SYM && h->depth == LADDR_BUILDIN ? lbuildin_vals[h->slot].buildin : NULL;
+  Lnode* n;
+
+  if (b == buildin_if && v->count == 4
+      && v->cell[2]->type == LVAL_QEXPR && v->cell[2]->count
+      && v->cell[3]->type == LVAL_QEXPR && v->cell[3]->count) {
+    int c = lnode_type(v->cell[1], types);
+    bool t = c == LVAL_NUM || c == LVAL_BOOL;
+    lnode_unchecked += t;
+    n = lnode_new(t ? lnode_if_t : lnode_if, 3);
+    n->kids[0] = lnode_expr(v->cell[1], false, types);
+    n->kids[1] = lnode_list(v->cell[2], tail, types);
+    n->kids[2] = lnode_list(v->cell[3], tail, types);
+    return n;
+  }
+
+  // calls whose arguments have the types the builtin checks for
+  int op = b ? lvm_binop(b) : -1;
+  Lexec unchecked = NULL;
+  if (op >= 0 && lnode_args_are(v, types, LVAL_NUM)) {
+    unchecked = v->count == 3 ? lnode_binops_t[op] : v->count > 3 && op <= LOP_MUL ? lnode_folds_t[op] : NULL;
+  } else if (v->count == 2 && lnode_args_are(v, types, LVAL_QEXPR)) {
+    unchecked = b == buildin_len ? lnode_len_t : b == buildin_head ? lnode_head_t
+        : b == buildin_tail ? lnode_tail_t : NULL;
+  }
+  if (!unchecked && b == buildin_join && v->count > 2 && lnode_args_are(v, types, LVAL_QEXPR)) {
+    unchecked = lnode_join_t;
+  }
+
+  if (unchecked) {
+    n = lnode_new(unchecked, v->count - 1);
+    lnode_unchecked++;
+  } else if (b && v->count == 3 && op >= 0) {
+    n = lnode_new(lnode_binops[op], 2);
+  } else if (b) {
+    n = lnode_new(lnode_buildin, v->count - 1);
+  } else {
+    n = lnode_new(tail ? lnode_tailcall : lnode_call, v->count);
+  }
+  n->slot = b ? h->slot : 0;
+  for (int i = b ? 1 : 0; i < v->count; i++) {
+    n->kids[i - (b ? 1 : 0)] = lnode_expr(v->cell[i], false, types);
+  }
+  return n;
+}
+
+// Compile a resolved and linked lambda body. types are assumed of the
+// formals, two bits each for the first LTYPE_FORMALS: 1 a number, 2 a
+// Q-expression, 0 anything. A body the assumptions let skip more type
+// checks runs behind lnode_guard.
+Lnode* lnode_compile(Lval* body, unsigned types) {
+  lnode_unchecked = 0;
+  Lnode* any = lnode_list(body, true, 0);
+  if (!types) { return any; }
+
+  int checks = lnode_unchecked;
+  lnode_unchecked = 0;
+  Lnode* typed = lnode_list(body, true, types);
+  if (lnode_unchecked == checks) {
+    lnode_free(typed);
+    return any;
+  }
+
+  Lnode* n = lnode_new(lnode_guard, 2);
+  n->slot = types;
+  n->kids[0] = typed;
+  n->kids[1] = any;
+  return n;
+}
+
+static Lval* lnode_run(Lenv* e, Lfun* fn, Lval* l) {
+  Lenv frame;
+  int sp = lenv_frame_push(&frame, e, fn, l);
+  Lval* self = NULL;
+  Lval* r;
+
+  while ((r = LNODE_RUN(fn->node, &frame)) == &lnode_tail) {
+    Lval* a = lfun_args(lnode_tail_f->fun, lnode_tail_args);
+    lenv_frame_pop(&frame, sp);
+    if (self) { lval_del(self); }
+    self = lnode_tail_f;
+    Lfun* g = self->fun->base ? self->fun->base : self->fun;
+    if (g == fn) { ltier_loop(e, g); } else { ltier_call(e, g); }
+    fn = g;
+    sp = lenv_frame_push(&frame, e, fn, a);
+  }
+
+  lenv_frame_pop(&frame, sp);
+  if (self) { lval_del(self); }
+  return r;
+}
+
+static bool lval_mentions(Lval* v, char* sym);
+
+// -1 until the environment is checked for LISPY_NOJIT
+static int ljit_on = -1;
+
+// whether machine code, jitted or ahead of time, may run at all
+static bool ljit_enabled(void) {
+  if (ljit_on < 0) { ljit_on = getenv("LISPY_NOJIT") == NULL; }
+  return ljit_on;
+}
+
+static void ljit_free(Ljit* j) {
+  // ahead of time code is not mapped
+  if (j->size) { munmap((void*)j->code, j->size); }
+  free(j);
+}
+
+// set once a name ahead of time code calls directly is bound anew
+static bool ljit_aot_stale = false;
+
+// the machine code of fn if it is compiled and still trusted
+static Ljit* ljit_code(Lfun* fn) {
+  Ljit* j = __atomic_load_n(&fn->jit, __ATOMIC_ACQUIRE);
+  if (j && !j->size && __atomic_load_n(&ljit_aot_stale, __ATOMIC_RELAXED)) { return NULL; }
+  return j && __atomic_load_n(&j->bails, __ATOMIC_RELAXED) < LJIT_BAIL_MAX ? j : NULL;
+}
+
+// A call from machine code. The callee has to be compiled as well, its
+// result is then a number. Calls are counted like those of lval_call.
+static Ljit_ret ljit_call(Lval* sym, long* args, Lenv* glob, int argn) {
+  Ljit_ret r = { 0, 1 };
+  Lval* f = lenv_get(glob, sym);
+  Lfun* fn = f->type == LVAL_FUN && !f->buildin && !f->fun->base ? f->fun : NULL;
+  Ljit* j = fn ? ljit_code(fn) : NULL;
+  if (j && fn->formals->count == argn && leval_depth < LEVAL_DEPTH_MAX) {
+    leval_depth++;
+    r = j->code(args, glob);
+    leval_depth--;
+  }
+  lval_del(f);
+  return r;
+}
+
+// Run a call of fn as machine code. NULL leaves the call, with l
+// untouched, to the interpreter.
+static Lval* ljit_run(Lenv* e, Lfun* fn, Lval* l) {
+  Ljit* j = ljit_code(fn);
+  if (!j) { return NULL; }
+
+  long args[LJIT_ARGS_MAX];
+  for (int i = 0; i < l->count; i++) {
+    if (l->cell[i]->type != LVAL_NUM) { return NULL; }
+    args[i] = l->cell[i]->num;
+  }
+
+  Ljit_ret r = j->code(args, e->glob);
+  if (r.bail) {
+    // code that bails too often is given up, fn runs a tier lower
+    if (__atomic_add_fetch(&j->bails, 1, __ATOMIC_RELAXED) == LJIT_BAIL_MAX) {
+      int tier = fn->code || fn->node ? LTIER_COMPILED : LTIER_TREE;
+      __atomic_store_n(&fn->tier, tier, __ATOMIC_RELEASE);
+    }
+    return NULL;
+  }
+  lval_del(l);
+  Lval* x = lval_alloc();
+  x->type = LVAL_NUM;
+  x->num = r.val;
+  return x;
+}
+
+// promotions happen rarely, they take turns
+static pthread_mutex_t ltier_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Lopt* linline_body(Lenv* glob, Lfun* fn, bool walk);
+
+// lambdas whose compiled code inlined others, under ltier_lock
+static Lfun** lopt_live = NULL;
+static int lopt_nlive = 0;
+static int lopt_cap = 0;
+
+// linline_stats counts calls inlined and inlined code gone stale
+static struct { long sites; long stale; } linline_stats;
+
+// record the types of the arguments l of a call of fn it walks as a tree
+static void ltype_seen(Lfun* fn, Lval* l) {
+  if (LEXEC != LEXEC_CLOSURE || !fn->linked
+      || __atomic_load_n(&fn->tier, __ATOMIC_RELAXED) != LTIER_TREE) { return; }
+  unsigned long seen = __atomic_load_n(&fn->seen, __ATOMIC_RELAXED);
+  unsigned long s = seen;
+  for (int i = 0; i < l->count && i < LTYPE_FORMALS; i++) {
+    int t = l->cell[i]->type;
+    s |= (t == LVAL_NUM ? 1ul : t == LVAL_QEXPR ? 2ul : 4ul) << (4 * i);
+  }
+  if (s != seen) { __atomic_store_n(&fn->seen, s, __ATOMIC_RELAXED); }
+}
+
+// the types lnode_compile may assume of fn's formals
+static unsigned ltype_formals(Lfun* fn) {
+  unsigned long seen = __atomic_load_n(&fn->seen, __ATOMIC_RELAXED);
+  unsigned types = 0;
+  for (int i = 0; i < fn->formals->count && i < LTYPE_FORMALS; i++) {
+    int s = seen >> (4 * i) & 15;
+    types |= (s == 1 ? 1u : s == 2 ? 2u : 0u) << (2 * i);
+  }
+  return types;
+}
+
+// compile fn, with what it calls inlined when there is something to
+static void ltier_compile(Lenv* glob, Lfun* fn) {
+  int chain = 0;
+  for (Lopt* p = fn->opt; p; p = p->prev) { chain++; }
+  Lopt* o = linline_body(glob, fn, chain < LOPT_CHAIN_MAX);
+  // The code replaced may still be running further up the stack, it is
+  // freed with the chain. Once nothing is inlined any more the chain ends
+  // with the body as written, which depends on nothing and so is compiled
+  // for good.
+  if (!o && fn->opt) {
+    o = calloc(1, sizeof(Lopt));
+    o->body = lval_copy(fn->body);
+  }
+  Lval* body = o ? o->body : fn->body;
+  Lcode* code = LEXEC == LEXEC_VM ? lvm_compile(body) : NULL;
+  Lnode* node = LEXEC == LEXEC_CLOSURE ? lnode_compile(body, ltype_formals(fn)) : NULL;
+  if (o) {
+    o->code = code;
+    o->node = node;
+    o->prev = fn->opt;
+    if (!o->prev) {
+      if (lopt_nlive == lopt_cap) {
+        lopt_cap = lopt_cap ? lopt_cap * 2 : 16;
+        lopt_live = realloc(lopt_live, sizeof(Lfun*) * lopt_cap);
+      }
+      lopt_live[lopt_nlive++] = fn;
+    }
+    fn->opt = o;
+  }
+  __atomic_store_n(&fn->code, code, __ATOMIC_RELEASE);
+  __atomic_store_n(&fn->node, node, __ATOMIC_RELEASE);
+}
+
+static void ltier_promote(Lenv* glob, Lfun* fn, int tier) {
+  pthread_mutex_lock(&ltier_lock);
+  if (tier == LTIER_COMPILED && fn->tier == LTIER_TREE) {
+    // compiled the first time it gets hot, demotions keep the code unless
+    // what it inlined has changed
+    if ((!fn->code && !fn->node) || (fn->opt && fn->opt->stale)) { ltier_compile(glob, fn); }
+    __atomic_store_n(&fn->tier, tier, __ATOMIC_RELEASE);
+  }
+  if (tier == LTIER_JIT && fn->tier != LTIER_JIT) {
+    if (ljit_enabled() && !fn->jit) { __atomic_store_n(&fn->jit, ljit_compile(fn), __ATOMIC_RELEASE); }
+    if (ljit_code(fn)) { __atomic_store_n(&fn->tier, tier, __ATOMIC_RELEASE); }
+  }
+  pthread_mutex_unlock(&ltier_lock);
+}
+
+// Counts are bumped without a locked add, threads calling the same
+// lambda at once may lose some of each other's counts.
+static int ltier_count(int* n) {
+  int x = __atomic_load_n(n, __ATOMIC_RELAXED) + 1;
+  __atomic_store_n(n, x, __ATOMIC_RELAXED);
+  return x;
+}
+
+// count a call of fn, promoting it once it is hot
+static void ltier_call(Lenv* e, Lfun* fn) {
+  int calls = ltier_count(&fn->calls);
+  int tier = __atomic_load_n(&fn->tier, __ATOMIC_RELAXED);
+  if (LEXEC != LEXEC_TREE && tier == LTIER_TREE && fn->linked
+      && calls + __atomic_load_n(&fn->loops, __ATOMIC_RELAXED) >= LTIER_THRESHOLD) {
+    ltier_promote(e->glob, fn, LTIER_COMPILED);
+  }
+  // only the call that reaches the threshold tries
+  if (LJIT_ENABLE && calls == LJIT_THRESHOLD) { ltier_promote(e->glob, fn, LTIER_JIT); }
+}
+
+// count a tail call of fn back to itself
+static void ltier_loop(Lenv* e, Lfun* fn) {
+  int loops = ltier_count(&fn->loops);
+  int tier = __atomic_load_n(&fn->tier, __ATOMIC_RELAXED);
+  if (LEXEC != LEXEC_TREE && tier == LTIER_TREE && fn->linked
+      && loops + __atomic_load_n(&fn->calls, __ATOMIC_RELAXED) >= LTIER_THRESHOLD) {
+    ltier_promote(e->glob, fn, LTIER_COMPILED);
+  }
+}
+
+static void ltier_reset(Lfun* fn) {
+  __atomic_store_n(&fn->tier, LTIER_TREE, __ATOMIC_RELEASE);
+  __atomic_store_n(&fn->calls, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&fn->loops, 0, __ATOMIC_RELAXED);
+}
+
+// code that inlined dep is stale, its lambdas go back to the tree walker
+static void lopt_invalidate(Lfun* dep) {
+  for (int i = 0; i < lopt_nlive; i++) {
+    Lopt* o = lopt_live[i]->opt;
+    for (int j = 0; j < o->ndeps && !o->stale; j++) {
+      if (o->deps[j] != dep) { continue; }
+      o->stale = true;
+      ltier_reset(lopt_live[i]);
+      linline_stats.stale++;
+    }
+  }
+}
+
+static void lopt_free(Lfun* fn) {
+  pthread_mutex_lock(&ltier_lock);
+  for (int i = 0; i < lopt_nlive; i++) {
+    if (lopt_live[i] == fn) { lopt_live[i] = lopt_live[--lopt_nlive]; break; }
+  }
+  pthread_mutex_unlock(&ltier_lock);
+
+  while (fn->opt) {
+    Lopt* o = fn->opt;
+    fn->opt = o->prev;
+    if (o->code) { lvm_free(o->code); }
+    if (o->node) { lnode_free(o->node); }
+    lval_del(o->body);
+    free(o->deps);
+    free(o);
+  }
+}
+
+// v is no longer bound where old was, a lambda that was goes back to the
+// tree walker
+static void ltier_demote(Lval* old, Lval* v) {
+  if (old->type != LVAL_FUN || old->buildin || old->fun->base) { return; }
+  if (v->type == LVAL_FUN && !v->buildin && v->fun == old->fun) { return; }
+  Lfun* fn = old->fun;
+
+  pthread_mutex_lock(&ltier_lock);
+  // ahead of time code calls the others by name without looking them up
+  Ljit* j = fn->jit;
+  if (j && !j->size) { __atomic_store_n(&ljit_aot_stale, true, __ATOMIC_RELAXED); }
+  ltier_reset(fn);
+  if (fn->watched) { lopt_invalidate(fn); }
+  pthread_mutex_unlock(&ltier_lock);
+}
+
+#if defined(__x86_64__)
+
+static void ljit_emit(Lasm* a, int n, const unsigned char* bytes) {
+  if (a->count + n > a->cap) {
+    a->cap = a->cap ? a->cap * 2 + n : 256;
+    a->buf = realloc(a->buf, a->cap);
+  }
+  memcpy(a->buf + a->count, bytes, n);
+  a->count += n;
+}
+
+#define LJIT_EMIT(a, ...) do { \
+    const unsigned char ljit_bytes[] = { __VA_ARGS__ }; \
+    ljit_emit(a, sizeof(ljit_bytes), ljit_bytes); \
+  } while (0)
+
+static void ljit_imm32(Lasm* a, int x) { ljit_emit(a, 4, (unsigned char*)&x); }
+static void ljit_imm64(Lasm* a, long x) { ljit_emit(a, 8, (unsigned char*)&x); }
+
+// a jump whose 32 bit displacement is patched later, returns where it is
+static int ljit_jump(Lasm* a, bool cond, unsigned char cc) {
+  if (cond) { LJIT_EMIT(a, 0x0f, cc); } else { LJIT_EMIT(a, 0xe9); }
+  ljit_imm32(a, 0);
+  return a->count - 4;
+}
+
+static void ljit_patch(Lasm* a, int at, int target) {
+  int rel = target - (at + 4);
+  memcpy(a->buf + at, &rel, 4);
+}
+
+// jump to the bail out on condition cc
+static void ljit_bail(Lasm* a, unsigned char cc) {
+  a->bails = realloc(a->bails, sizeof(int) * (a->nbail + 1));
+  a->bails[a->nbail++] = ljit_jump(a, true, cc);
+}
+
+static bool ljit_list(Lasm* a, Lval* v, int formaln);
+
+// emit code leaving the value of v in rax
+static bool ljit_expr(Lasm* a, Lval* v, int formaln) {
+  if (v->type == LVAL_SEXPR) { return ljit_list(a, v, formaln); }
+  if (v->type == LVAL_NUM) {
+    if (v->num == (int)v->num) {
+      LJIT_EMIT(a, 0x48, 0xc7, 0xc0); ljit_imm32(a, (int)v->num); // mov rax, imm32
+    } else {
+      LJIT_EMIT(a, 0x48, 0xb8); ljit_imm64(a, v->num);            // mov rax, imm64
+    }
+    return true;
+  }
+  if (v->type == LVAL_SYM && v->depth == 0 && v->slot >= 0 && v->slot < formaln) {
+    LJIT_EMIT(a, 0x48, 0x8b, 0x83); ljit_imm32(a, v->slot * 8);   // mov rax, [rbx + 8 * slot]
+    return true;
+  }
+  return false;
+}
+
+static bool ljit_list(Lasm* a, Lval* v, int formaln) {
+  if (v->count == 0) { return false; }
+  if (v->count == 1) { return ljit_expr(a, v->cell[0], formaln); }
+
+  Lval* h = v->cell[0];
+  if (h->type != LVAL_SYM) { return false; }
+
+  if (h->depth == LADDR_GLOBAL) {
+    // arguments go on the stack in reverse so the callee reads them in
+    // order, a pad keeps rsp 16 byte aligned at the call
+    int argn = v->count - 1;
+    int pad = (a->depth + argn) % 2;
+    if (pad) { LJIT_EMIT(a, 0x48, 0x83, 0xec, 0x08); a->depth++; } // sub rsp, 8
+    for (int i = v->count - 1; i > 0; i--) {
+      if (!ljit_expr(a, v->cell[i], formaln)) { return false; }
+      LJIT_EMIT(a, 0x50); a->depth++;                              // push rax
+    }
+    LJIT_EMIT(a, 0x48, 0xbf); ljit_imm64(a, (long)h);              // mov rdi, sym
+    LJIT_EMIT(a, 0x48, 0x89, 0xe6);                                // mov rsi, rsp
+    LJIT_EMIT(a, 0x4c, 0x89, 0xe2);                                // mov rdx, r12
+    LJIT_EMIT(a, 0xb9); ljit_imm32(a, argn);                       // mov ecx, argn
+    LJIT_EMIT(a, 0x48, 0xb8); ljit_imm64(a, (long)ljit_call);      // mov rax, ljit_call
+    LJIT_EMIT(a, 0xff, 0xd0);                                      // call rax
+    LJIT_EMIT(a, 0x48, 0x81, 0xc4); ljit_imm32(a, (argn + pad) * 8); // add rsp, n
+    a->depth -= argn + pad;
+    LJIT_EMIT(a, 0x48, 0x85, 0xd2);                                // test rdx, rdx
+    ljit_bail(a, 0x85);                                            // jnz bail
+    return true;
+  }
+
+  if (h->depth != LADDR_BUILDIN) { return false; }
+  Lbuildin b = lbuildin_vals[h->slot].buildin;
+
+  if (b == buildin_if && v->count == 4
+      && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR) {
+    if (!ljit_expr(a, v->cell[1], formaln)) { return false; }
+    LJIT_EMIT(a, 0x48, 0x85, 0xc0);                                // test rax, rax
+    int other = ljit_jump(a, true, 0x84);                          // jz else
+    if (!ljit_list(a, v->cell[2], formaln)) { return false; }
+    int end = ljit_jump(a, false, 0);                              // jmp end
+    ljit_patch(a, other, a->count);
+    if (!ljit_list(a, v->cell[3], formaln)) { return false; }
+    ljit_patch(a, end, a->count);
+    return true;
+  }
+
+  int op = b && v->count == 3 ? lvm_binop(b) : -1;
+  if (op < 0) { return false; }
+  if (!ljit_expr(a, v->cell[1], formaln)) { return false; }
+  LJIT_EMIT(a, 0x50); a->depth++;                                  // push rax
+  if (!ljit_expr(a, v->cell[2], formaln)) { return false; }
+  LJIT_EMIT(a, 0x48, 0x89, 0xc1);                                  // mov rcx, rax
+  LJIT_EMIT(a, 0x58); a->depth--;                                  // pop rax
+
+  // the builtin reports overflow and division by zero
+  unsigned char cc = 0;
+  switch (op) {
+    case LOP_ADD: LJIT_EMIT(a, 0x48, 0x01, 0xc8); ljit_bail(a, 0x80); break;       // add rax, rcx; jo bail
+    case LOP_SUB: LJIT_EMIT(a, 0x48, 0x29, 0xc8); ljit_bail(a, 0x80); break;       // sub rax, rcx; jo bail
+    case LOP_MUL: LJIT_EMIT(a, 0x48, 0x0f, 0xaf, 0xc1); ljit_bail(a, 0x80); break; // imul rax, rcx; jo bail
+    case LOP_DIV:
+    case LOP_MOD:
+      LJIT_EMIT(a, 0x48, 0x85, 0xc9);                              // test rcx, rcx
+      ljit_bail(a, 0x84);                                          // jz bail
+      // idiv traps on the smallest number by -1
+      LJIT_EMIT(a, 0x48, 0x83, 0xf9, 0xff);                        // cmp rcx, -1
+      ljit_bail(a, 0x84);                                          // je bail
+      LJIT_EMIT(a, 0x48, 0x99);                                    // cqo
+      LJIT_EMIT(a, 0x48, 0xf7, 0xf9);                              // idiv rcx
+      if (op == LOP_MOD) { LJIT_EMIT(a, 0x48, 0x89, 0xd0); }       // mov rax, rdx
+      break;
+    case LOP_LT: cc = 0x9c; break;
+    case LOP_LE: cc = 0x9e; break;
+    case LOP_GT: cc = 0x9f; break;
+    case LOP_GE: cc = 0x9d; break;
+    case LOP_EQ: cc = 0x94; break;
+    case LOP_NE: cc = 0x95; break;
+  }
+  if (cc) {
+    LJIT_EMIT(a, 0x48, 0x39, 0xc8);                                // cmp rax, rcx
+    LJIT_EMIT(a, 0x0f, cc, 0xc0);                                  // setcc al
+    LJIT_EMIT(a, 0x0f, 0xb6, 0xc0);                                // movzx eax, al
+  }
+  return true;
+}
+
+// list the code for perf, one line per lambda
+static void ljit_perf_map(Ljit* j, Lfun* fn) {
+  static int n = 0;
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  FILE* f = fopen(path, "a");
+  if (!f) { return; }
+  fprintf(f, "%lx %zx lispy_lambda_%d_", (unsigned long)j->code, j->size, __atomic_add_fetch(&n, 1, __ATOMIC_RELAXED));
+  for (int i = 0; i < fn->formals->count; i++) {
+    fprintf(f, "%s%s", i ? "_" : "", fn->formals->cell[i]->sym);
+  }
+  fputc('\n', f);
+  fclose(f);
+}
+
+// Compile fn, NULL if its body uses anything but what the JIT knows
+Ljit* ljit_compile(Lfun* fn) {
+  int formaln = fn->formals->count;
+  if (fn->base || formaln == 0 || formaln > LJIT_ARGS_MAX) { return NULL; }
+  if (lval_mentions(fn->body, lsym_intern("=", lsym_hash("=")))) { return NULL; }
+
+  Lasm a = { 0 };
+  LJIT_EMIT(&a, 0x55);                                             // push rbp
+  LJIT_EMIT(&a, 0x48, 0x89, 0xe5);                                 // mov rbp, rsp
+  LJIT_EMIT(&a, 0x53);                                             // push rbx
+  LJIT_EMIT(&a, 0x41, 0x54);                                       // push r12
+  LJIT_EMIT(&a, 0x48, 0x89, 0xfb);                                 // mov rbx, rdi
+  LJIT_EMIT(&a, 0x49, 0x89, 0xf4);                                 // mov r12, rsi
+
+  bool ok = ljit_list(&a, fn->body, formaln);
+
+  LJIT_EMIT(&a, 0x31, 0xd2);                                       // xor edx, edx
+  int done = ljit_jump(&a, false, 0);                              // jmp exit
+  for (int i = 0; i < a.nbail; i++) { ljit_patch(&a, a.bails[i], a.count); }
+  LJIT_EMIT(&a, 0xba, 0x01, 0x00, 0x00, 0x00);                     // mov edx, 1
+  ljit_patch(&a, done, a.count);
+  LJIT_EMIT(&a, 0x48, 0x8d, 0x65, 0xf0);                           // lea rsp, [rbp - 16]
+  LJIT_EMIT(&a, 0x41, 0x5c);                                       // pop r12
+  LJIT_EMIT(&a, 0x5b);                                             // pop rbx
+  LJIT_EMIT(&a, 0x5d);                                             // pop rbp
+  LJIT_EMIT(&a, 0xc3);                                             // ret
+  free(a.bails);
+
+  Ljit* j = NULL;
+  if (ok) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (a.count + page - 1) / page * page;
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+      memcpy(mem, a.buf, a.count);
+      if (mprotect(mem, size, PROT_READ | PROT_EXEC) == 0) {
+        j = calloc(1, sizeof(Ljit));
+        j->code = (Ljit_ret (*)(long*, Lenv*))mem;
+        j->size = size;
+        ljit_perf_map(j, fn);
+      } else {
+        munmap(mem, size);
+      }
+    }
+  }
+  free(a.buf);
+  return j;
+}
+
+#else
+
+Ljit* ljit_compile(Lfun* fn) { return NULL; }
+
+#endif
+
+// take at the child out of v at index i
+Lval* lval_take(Lval* v, int i) {
+  Lval* x = lval_pop(v, i);
+  lval_del(v);
+  return x;
+};
+
+// pop the child at index i
+Lval* lval_pop(Lval* v, int i) {
+  // hold that variable
+  Lval* x = v->cell[i];
+
+  // shift the after array over
+  memmove(&v->cell[i], &v->cell[i + 1], sizeof(Lval*) * (v->count - i - 1));
+
+  // reduce the count
+  v->count--;
+  v->cell = realloc(v->cell, sizeof(Lval*) * (v->count));
+
+  return x;
+};
+
+// insert the child at index i
+Lval* lval_insert(Lval* v, Lval* a, int i) {
+  assert(v->type == LVAL_SEXPR || v->type == LVAL_QEXPR);
+  v->count++;
+  v->cell = realloc(v->cell, sizeof(Lval*) * v->count);
+  // move for the position of new element
+  memmove(&v->cell[i + 1], &v->cell[i], sizeof(Lval*) * (v->count - i - 1));
+
+  v->cell[i] = a;
+  return v;
+
+  // hold that variable
+  Lval* x = v->cell[i];
+
+  // shift the after array over
+  memmove(&v->cell[i], &v->cell[i + 1], sizeof(Lval*) * (v->count - i - 1));
+
+  // reduce the count
+  v->count--;
+  v->cell = realloc(v->cell, sizeof(Lval*) * (v->count));
+
+  return x;
+};
+
+Lval* lval_join(Lval* v, Lval* u) {
+  while(u->count != 0) {
+    lval_add(v, lval_pop(u, 0));
+  }
+
+  lval_del(u);
+  return v;
+};
+
+// source of binding versions and frame shapes, shared by every environment
+static unsigned long lenv_version = 0;
+
+static unsigned long lenv_stamp(void) {
+  return __atomic_add_fetch(&lenv_version, 1, __ATOMIC_RELAXED);
+}
+
+// Readers of shared frames announce the epoch they entered in, writers
+// stamp what they replace with the epoch after the change. Anything
+// stamped no later than the oldest announced epoch is out of every
+// reader's sight. A thread holds a slot from its first read until it
+// ends, slots are padded apart so readers never share a line. With every
+// slot taken a thread reads under the write lock instead.
+#define LENV_READERS_MAX 256
+static unsigned long lenv_epoch = 1;
+static struct { unsigned long epoch; int used; char pad[52]; } lenv_readers[LENV_READERS_MAX];
+static int lenv_reader_count = 0; // slots below this may be in use
+static __thread int lenv_reader = -1;
+
+// replaced snapshots and values waiting for their readers to leave,
+// writers of shared frames take turns on the lock. It may be taken with
+// ltier_lock held but never the other way round.
+typedef struct Lretired {
+  Lenv* snap; // its values live on in the snapshot that replaced it
+  Lval* val;
+  unsigned long epoch;
+  struct Lretired* next;
+} Lretired;
+static Lretired* lenv_retired = NULL;
+static pthread_mutex_t lenv_write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lenv_reader_take(void) {
+  for (int i = 0; i < LENV_READERS_MAX; i++) {
+    int free = 0;
+    if (__atomic_load_n(&lenv_readers[i].used, __ATOMIC_RELAXED) ||
+        !__atomic_compare_exchange_n(&lenv_readers[i].used, &free, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      continue;
+    }
+    int n = __atomic_load_n(&lenv_reader_count, __ATOMIC_SEQ_CST);
+    while (n <= i && !__atomic_compare_exchange_n(&lenv_reader_count, &n, i + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {}
+    lenv_reader = i;
+    lthread_track();
+    return;
+  }
+}
+
+static void lenv_read_begin(void) {
+  if (lenv_reader < 0) { lenv_reader_take(); }
+  if (lenv_reader < 0) {
+    pthread_mutex_lock(&lenv_write_lock);
+    return;
+  }
+  unsigned long epoch = __atomic_load_n(&lenv_epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&lenv_readers[lenv_reader].epoch, epoch, __ATOMIC_SEQ_CST);
+}
+
+static void lenv_read_end(void) {
+  if (lenv_reader < 0) {
+    pthread_mutex_unlock(&lenv_write_lock);
+    return;
+  }
+  __atomic_store_n(&lenv_readers[lenv_reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Per-thread state is released by lthread_exit when a thread that made
+// any ends. Values may outlive the thread in other threads' hands, so
+// its free slots go to lval_spare rather than back to malloc.
+static pthread_key_t lthread_key;
+static pthread_once_t lthread_once = PTHREAD_ONCE_INIT;
+static __thread bool lthread_tracked = false;
+
+static void lthread_exit(void* unused) {
+  (void)unused;
+  lval_reclaim(INT_MAX);
+  if (lval_free_list) {
+    Lval* last = lval_free_list;
+    while (last->next) { last = last->next; }
+    pthread_mutex_lock(&lval_spare_lock);
+    last->next = lval_spare;
+    __atomic_store_n(&lval_spare, lval_free_list, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lval_spare_lock);
+    lval_free_list = NULL;
+  }
+
+  free(lenv_stack);
+  lenv_stack = NULL;
+  free(lvm_stack);
+  lvm_stack = NULL;
+  free(lwalk_stack);
+  lwalk_stack = NULL;
+  lwalk_cap = 0;
+
+  if (lenv_reader >= 0) {
+    __atomic_store_n(&lenv_readers[lenv_reader].epoch, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&lenv_readers[lenv_reader].used, 0, __ATOMIC_SEQ_CST);
+    lenv_reader = -1;
+  }
+  lthread_tracked = false;
+}
+
+static void lthread_key_init(void) {
+  pthread_key_create(&lthread_key, lthread_exit);
+}
+
+static void lthread_track(void) {
+  if (lthread_tracked) { return; }
+  pthread_once(&lthread_once, lthread_key_init);
+  // destructors only run for keys with a value
+  pthread_setspecific(lthread_key, &lthread_tracked);
+  lthread_tracked = true;
+}
+
+Lenv* lenv_new(void) {
+  Lenv* e = malloc(sizeof(Lenv));
+  e->count = 0;
+  e->cap = 0;
+  e->par = NULL;
+  e->glob = e;
+  e->entries = NULL;
+  e->index = NULL;
+  e->mask = 0;
+  e->stack = false;
+  e->buildins = false;
+  e->base = NULL;
+  e->ref = 1;
+  e->shape = lenv_stamp();
+  e->shared = false;
+  e->snap = NULL;
+  e->mod = NULL;
+  e->bloom = 0;
+  return e;
+};
+
+static void lmod_del(Lmodule* m);
+
+void lenv_del(Lenv* e) {
+  if (e->shared) { lenv_del(e->snap); }
+  if (e->mod) { lmod_del(e->mod); }
+  for (int i = 0; i < e->count; i++) {
+    lval_del(e->entries[i].val);
+  }
+
+  free(e->entries);
+  free(e->index);
+  if (e->base && LREF_DEC(e->base->ref) == 0) { lenv_del(e->base); }
+  free(e);
+};
+
+// free a snapshot's tables but not the values in them
+static void lenv_drop(Lenv* t) {
+  free(t->entries);
+  free(t->index);
+  if (t->base && LREF_DEC(t->base->ref) == 0) { lenv_del(t->base); }
+  free(t);
+}
+
+// position of the entry bound to sym in this frame only, -1 if none
+static int lenv_find(Lenv* e, char* sym, unsigned long hash) {
+  if (!e->index) {
+    for (int i = 0; i < e->count; i++) {
+      if (e->entries[i].sym == sym) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  for (unsigned long s = hash & e->mask; e->index[s]; s = (s + 1) & e->mask) {
+    Lentry* x = &e->entries[e->index[s] - 1];
+    if (x->sym == sym) {
+      return e->index[s] - 1;
+    }
+  }
+  return -1;
+}
+
+// rebuild the index at twice the load it has to hold
+static void lenv_reindex(Lenv* e) {
+  int size = 16;
+  while (size < e->count * 2) { size *= 2; }
+
+  free(e->index);
+  e->index = calloc(size, sizeof(int));
+  e->mask = size - 1;
+
+  for (int i = 0; i < e->count; i++) {
+    unsigned long s = e->entries[i].hash & e->mask;
+    while (e->index[s]) { s = (s + 1) & e->mask; }
+    e->index[s] = i + 1;
+  }
+}
+
+// whether entry i of the frame is bound to symbol k
+static bool lenv_holds(Lenv* e, int i, Lval* k) {
+  return i < e->count && e->entries[i].sym == k->sym;
+}
+
+// Look k up in a global frame, the bases it was forked from and the
+// builtins. Returns the bound value itself and fills c, when given.
+static Lval* lenv_global(Lenv* g, Lval* k, Lcache* c) {
+  for (Lenv* t = g; t; t = t->base) {
+    int i = lenv_find(t, k->sym, k->hash);
+    if (i >= 0) {
+      if (c) { c->shape = g->shape; c->entry = &t->entries[i]; }
+      return t->entries[i].val;
+    }
+  }
+
+  // misses are cached too, as builtin -1
+  int i = g->buildins ? lbuildin_find(k) : -1;
+  if (c) { c->shape = g->shape; c->entry = NULL; c->buildin = i; }
+  return i >= 0 ? &lbuildin_vals[i] : NULL;
+}
+
+static Lval* lmod_load(Lenv* g, Lval* k);
+
+// lookup counters of this thread
+static __thread struct {
+  long lookups;
+  long addressed; // found by lexical address
+  long cached;    // answered by an inline cache, misses included
+  long frames;    // searched or skipped while walking a chain
+  long skipped;   // ruled out by their filter
+  long chain_max; // longest walk
+  long unbound;
+} lenv_stats;
+
+// lenv_find for a frame on a lookup's chain, filtered
+static int lenv_probe(Lenv* f, Lval* k) {
+  unsigned long b = LENV_BLOOM(k->hash);
+  if (LENV_STATS) { lenv_stats.frames++; }
+  if ((f->bloom & b) != b) {
+    if (LENV_STATS) { lenv_stats.skipped++; }
+    return -1;
+  }
+  return lenv_find(f, k->sym, k->hash);
+}
+
+static void lenv_chain(int n) {
+  if (LENV_STATS && n > lenv_stats.chain_max) { lenv_stats.chain_max = n; }
+}
+
+// a copy of the global binding of k, shared frames are read from their
+// current snapshot and never cached
+static Lval* lenv_get_global(Lenv* g, Lval* k, Lcache* c) {
+  Lval* x;
+  if (g->shared) {
+    lenv_read_begin();
+    x = lenv_global(__atomic_load_n(&g->snap, __ATOMIC_SEQ_CST), k, NULL);
+    x = x ? lval_copy(x) : NULL;
+    lenv_read_end();
+  } else {
+    x = lenv_global(g, k, c);
+    x = x ? lval_copy(x) : NULL;
+  }
+  if (x) { return x; }
+
+  // an imported definition of k runs now, then k is looked up again
+  if (g->mod && !g->shared && (x = lmod_load(g, k))) {
+    if (x->type == LVAL_ERR) { return x; }
+    lval_del(x);
+    return lenv_get_global(g, k, c);
+  }
+  if (LENV_STATS) { lenv_stats.unbound++; }
+  return lval_err("unbound symbol %s", k->sym);
+}
+
+Lval* lenv_get(Lenv* e, Lval* k) {
+  if (LENV_STATS) { lenv_stats.lookups++; }
+  if (k->depth == LADDR_BUILDIN) { return lval_copy(&lbuildin_vals[k->slot]); }
+
+  // resolved symbols index their frame directly, stale addresses
+  // (the symbol was evaluated somewhere else) fall back to the name
+  if (k->depth >= 0 && k->slot >= 0) {
+    Lenv* f = e;
+    for (int d = k->depth; d && f; d--) { f = f->par; }
+    if (f && lenv_holds(f, k->slot, k)) {
+      if (LENV_STATS) { lenv_stats.addressed++; }
+      return lval_copy(f->entries[k->slot].val);
+    }
+  }
+
+  int n = 0;
+  if (k->depth == LADDR_GLOBAL) {
+    // only a local added at run time by = can shadow it
+    for (Lenv* f = e; f && f != e->glob; f = f->par, n++) {
+      int i = lenv_probe(f, k);
+      if (i >= 0) { lenv_chain(n + 1); return lval_copy(f->entries[i].val); }
+    }
+    lenv_chain(n);
+
+    // shapes are unique and change whenever a binding is added or a file
+    // is imported, while it holds the cached entry is still where the
+    // name resolves. Entries do not move and = or def update them in place.
+    // shared frames are only read through lenv_get_global, entries cached
+    // before lenv_share would be freed under the reader
+    Lcache* c = k->cache;
+    if (!e->glob->shared && c->shape == e->glob->shape) {
+      if (LENV_STATS) { lenv_stats.cached++; }
+      if (c->entry) { return lval_copy(c->entry->val); }
+      if (c->buildin >= 0) { return lval_copy(&lbuildin_vals[c->buildin]); }
+      if (LENV_STATS) { lenv_stats.unbound++; }
+      return lval_err("unbound symbol %s", k->sym);
+    }
+
+    return lenv_get_global(e->glob, k, c);
+  }
+
+  // the lexical chain ends at the captures, globals come from the caller
+  for (Lenv* f = e; f != e->glob; f = f->par ? f->par : e->glob, n++) {
+    int i = lenv_probe(f, k);
+    if (i >= 0) {
+      lenv_chain(n + 1);
+      return lval_copy(f->entries[i].val); // internal immutable data structure
+    }
+  }
+  lenv_chain(n);
+
+  return lenv_get_global(e->glob, k, NULL);
+};
+
+// position of k among the formals, -1 if it is not one
+static int lval_formal(Lval* formals, Lval* k) {
+  for (int i = 0; i < formals->count; i++) {
+    if (formals->cell[i]->sym == k->sym) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Resolve the symbols of a lambda body. Formals take the first slots of
+// the call frame in order and captures sit one frame up. Everything else
+// is taken to be global and gets an inline cache, filled now if glob
+// already binds it and on first lookup otherwise.
+void lval_resolve(Lval* v, Lval* formals, Lenv* cap, Lenv* glob) {
+  switch (v->type) {
+    case LVAL_SYM:
+      if (v->cache && LREF_DEC(v->cache->ref) == 0) { free(v->cache); }
+      v->cache = NULL;
+      v->depth = 0;
+      v->slot = lval_formal(formals, v);
+      if (v->slot >= 0) { return; }
+
+      if (cap) {
+        v->depth = 1;
+        v->slot = lenv_find(cap, v->sym, v->hash);
+        if (v->slot >= 0) { return; }
+      }
+
+      v->depth = LADDR_GLOBAL;
+      v->cache = malloc(sizeof(Lcache));
+      v->cache->ref = 1;
+      v->cache->shape = 0;
+      if (!glob->shared) { lenv_global(glob, v, v->cache); }
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) {
+        lval_resolve(v->cell[i], formals, cap, glob);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+// whether v mentions the symbol sym anywhere
+static bool lval_mentions(Lval* v, char* sym) {
+  if (v->type == LVAL_SYM) { return v->sym == sym; }
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return false; }
+  for (int i = 0; i < v->count; i++) {
+    if (lval_mentions(v->cell[i], sym)) { return true; }
+  }
+  return false;
+}
+
+// Link the heads of calls in a resolved lambda body to the builtins they
+// name. Builtins are frozen, so only a local that = adds at run time could
+// shadow one and bodies that use = are left alone. Code is every
+// S-expression, the body itself and the branches of if; other
+// Q-expressions are data.
+void lval_link(Lval* v, Lenv* glob, bool code) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+  code = code || v->type == LVAL_SEXPR;
+
+  Lval* h = v->count ? v->cell[0] : NULL;
+  if (code && h && h->type == LVAL_SYM && h->depth == LADDR_GLOBAL && glob->buildins) {
+    int i = lbuildin_find(h);
+    if (i >= 0 && lbuildin_vals[i].type == LVAL_FUN) {
+      if (LREF_DEC(h->cache->ref) == 0) { free(h->cache); }
+      h->cache = NULL;
+      h->depth = LADDR_BUILDIN;
+      h->slot = i;
+    }
+  }
+
+  // (if cond {then} {else})
+  bool branch = code && h && h->depth == LADDR_BUILDIN
+    && lbuildin_vals[h->slot].buildin == buildin_if;
+  for (int i = 0; i < v->count; i++) {
+    lval_link(v->cell[i], glob, branch && i >= 2);
+  }
+}
+
+// builtins without effects whose checks are safe to run early, a call of
+// one on constants is made once, when the lambda is made
+static bool lbuildin_pure(Lbuildin b) {
+  return b == buildin_list || b == buildin_head || b == buildin_tail
+    || b == buildin_join || b == buildin_cons || b == buildin_len
+    || b == buildin_eq || b == buildin_neq
+    || b == buildin_or || b == buildin_and || b == buildin_not;
+}
+
+// values that evaluate to themselves
+static bool lval_constant(Lval* v) {
+  return v->type == LVAL_NUM || v->type == LVAL_BOOL || v->type == LVAL_QEXPR;
+}
+
+// the numbers in v folded by op the way the backends fold them, NULL when
+// that fails, for division by zero say, and the call is left to run
+static Lval* lval_fold_arith(int op, Lval* v) {
+  if (v->count < 3 || (op > LOP_MOD && v->count != 3)) { return NULL; }
+  for (int i = 1; i < v->count; i++) {
+    if (v->cell[i]->type != LVAL_NUM) { return NULL; }
+  }
+  Lval* x = lval_copy(v->cell[1]);
+  for (int i = 2; i < v->count; i++) {
+    if (!lvm_arith(op, x, v->cell[i])) {
+      lval_del(x);
+      return NULL;
+    }
+  }
+  return x;
+}
+
+static Lval* lval_fold_branch(Lval* q, Lenv* glob);
+
+// Fold v, an S-expression of a linked body: calls of pure builtins on
+// constants become their value, an if on a constant becomes its branch.
+// A call that would fail is kept, to fail when it runs.
+static Lval* lval_fold(Lval* v, Lenv* glob) {
+  int linked = lval_linked(v);
+  Lbuildin b = linked ? lbuildin_vals[linked - 1].buildin : NULL;
+  bool constant = true;
+
+  for (int i = linked ? 1 : 0; i < v->count; i++) {
+    Lval* x = v->cell[i];
+    if (x->type == LVAL_SEXPR) {
+      x = lval_fold(x, glob);
+    } else if (b == buildin_if && i >= 2 && x->type == LVAL_QEXPR) {
+      x = lval_fold_branch(x, glob);
+    } else if (x->type == LVAL_SYM && x->depth == LADDR_GLOBAL && glob->buildins) {
+      // true and false
+      int j = lbuildin_find(x);
+      if (j >= 0 && lbuildin_vals[j].type == LVAL_BOOL) {
+        lval_del(x);
+        x = lval_copy(&lbuildin_vals[j]);
+      }
+    }
+    v->cell[i] = x;
+    constant = constant && lval_constant(x);
+  }
+
+  if (b == buildin_if && v->count == 4
+      && (v->cell[1]->type == LVAL_NUM || v->cell[1]->type == LVAL_BOOL)
+      && v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR
+      && v->cell[v->cell[1]->num ? 2 : 3]->count) {
+    Lval* r = lval_pop(v, v->cell[1]->num ? 2 : 3);
+    lval_del(v);
+    r->type = LVAL_SEXPR;
+    v = r;
+    linked = lval_linked(v);
+    b = NULL;
+  }
+
+  Lval* r = NULL;
+  int op = b ? lvm_binop(b) : -1;
+  if (op >= 0) { r = lval_fold_arith(op, v); }
+  if (!r && b && lbuildin_pure(b) && constant) {
+    Lval* a = lval_copy(v);
+    lval_del(lval_pop(a, 0));
+    r = b(glob, a);
+    if (!lval_constant(r)) {
+      lval_del(r);
+      r = NULL;
+    }
+  }
+  if (!r && !linked && v->count == 1 && lval_constant(v->cell[0])) { r = lval_pop(v, 0); }
+  if (!r) { return v; }
+  lval_del(v);
+  return r;
+}
+
+// a branch of if, or a body, folded as the S-expression it runs as
+static Lval* lval_fold_branch(Lval* q, Lenv* glob) {
+  q->type = LVAL_SEXPR;
+  q = lval_fold(q, glob);
+  if (q->type == LVAL_SEXPR) {
+    q->type = LVAL_QEXPR;
+    return q;
+  }
+  return lval_add(lval_qexp(), q);
+}
+
+static int lval_size(Lval* v) {
+  int n = 1;
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+    for (int i = 0; i < v->count; i++) { n += lval_size(v->cell[i]); }
+  }
+  return n;
+}
+
+// what inlining a call found so far
+typedef struct {
+  Lenv* glob; // or its snapshot, values found are borrowed
+  Lfun* fn; // being compiled
+  Lfun** deps;
+  int ndeps;
+  int sites;
+} Linline;
+
+static void linline_dep(Linline* in, Lfun* g) {
+  for (int i = 0; i < in->ndeps; i++) {
+    if (in->deps[i] == g) { return; }
+  }
+  in->deps = realloc(in->deps, sizeof(Lfun*) * (in->ndeps + 1));
+  in->deps[in->ndeps++] = g;
+}
+
+// a global a head names is fine to call from inlined code when it is a
+// lambda, which is then depended on, or a builtin that looks at no frame
+static bool linline_head(Linline* in, Lval* h) {
+  if (h->type != LVAL_SYM || h->depth != LADDR_GLOBAL) { return false; }
+  Lval* f = lenv_global(in->glob, h, NULL);
+  if (!f || f->type != LVAL_FUN) { return false; }
+  if (f->buildin) {
+    return lbuildin_pure(f->buildin) || lvm_binop(f->buildin) >= 0 || f->buildin == buildin_if;
+  }
+  linline_dep(in, f->fun);
+  return true;
+}
+
+// whether b, of the body of a lambda called by v, can run in the caller's
+// frame. Code is what lval_link takes for code.
+static bool linline_ok(Linline* in, Lval* v, Lval* b, bool code) {
+  if (b->type == LVAL_SYM) {
+    if (b->depth == 0) { return code; } // a formal, never in data
+    if (b->depth != LADDR_GLOBAL) { return true; }
+    // names the caller binds would be found first
+    Lfun* fn = in->fn;
+    return lval_formal(fn->formals, b) < 0 && (!fn->env || lenv_find(fn->env, b->sym, b->hash) < 0);
+  }
+  if (b->type != LVAL_SEXPR && b->type != LVAL_QEXPR) { return true; }
+
+  Lval* h = b->count ? b->cell[0] : NULL;
+  bool branch = false;
+  if (code && h && h->type == LVAL_SYM) {
+    if (h->depth == LADDR_BUILDIN) {
+      Lbuildin f = lbuildin_vals[h->slot].buildin;
+      if (!lbuildin_pure(f) && lvm_binop(f) < 0 && f != buildin_if) { return false; }
+      branch = f == buildin_if;
+    } else if (!linline_head(in, h->depth == 0 ? v->cell[h->slot + 1] : h)) {
+      return false;
+    }
+  }
+
+  for (int i = 0; i < b->count; i++) {
+    Lval* x = b->cell[i];
+    if (!linline_ok(in, v, x, code && (x->type != LVAL_QEXPR || (branch && i >= 2)))) { return false; }
+  }
+  return true;
+}
+
+// Where arguments of v are calls: the body has to evaluate each of them
+// once, in their order and outside branches, before it applies anything,
+// and to apply only builtins. The first error is then the one the call
+// would have given and nothing runs that would not have.
+typedef struct {
+  int last; // formal of the last argument evaluated
+  int used;
+  bool applied;
+} Lorder;
+
+// b is a value in code, or with list set, a list run as an S-expression
+static bool linline_order(Lval* b, Lval* v, bool list, bool branch, Lorder* o) {
+  if (b->type == LVAL_SYM && b->depth == 0) {
+    if (v->cell[b->slot + 1]->type != LVAL_SEXPR) { return true; }
+    if (branch || o->applied || b->slot <= o->last) { return false; }
+    o->last = b->slot;
+    o->used++;
+    return true;
+  }
+  if (b->type != LVAL_SEXPR && !list) { return true; }
+
+  Lval* h = b->count ? b->cell[0] : NULL;
+  if (b->count > 1 && (h->type != LVAL_SYM || h->depth != LADDR_BUILDIN)) { return false; }
+  bool cond = b->count > 1 && lbuildin_vals[h->slot].buildin == buildin_if;
+  for (int i = 0; i < b->count; i++) {
+    Lval* x = b->cell[i];
+    bool run = cond && i >= 2 && x->type == LVAL_QEXPR;
+    if (!linline_order(x, v, run, branch || run, o)) { return false; }
+  }
+  if (b->count > 1) { o->applied = true; }
+  return true;
+}
+
+static void linline_subst(Lval* b, Lval* v) {
+  for (int i = 0; i < b->count; i++) {
+    Lval* x = b->cell[i];
+    if (x->type == LVAL_SYM && x->depth == 0 && x->slot >= 0) {
+      b->cell[i] = lval_copy(v->cell[x->slot + 1]);
+      lval_del(x);
+    } else if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+      linline_subst(x, v);
+    }
+  }
+}
 
-  // hold that variable
-  Lval* x = v->cell[i];
+// a value with no names in it reads the same in any frame
+static bool lval_nameless(Lval* v) {
+  if (v->type == LVAL_SYM) { return false; }
+  for (int i = 0; (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && i < v->count; i++) {
+    if (!lval_nameless(v->cell[i])) { return false; }
+  }
+  return true;
+}
 
-  // shift the after array over
-  memmove(&v->cell[i], &v->cell[i + 1], sizeof(Lval*) * (v->count - i - 1));
+// whether b, in a body, applies the builtin op
+static bool linline_applies(Lval* b, Lbuildin op) {
+  Lval* h = b->type == LVAL_SEXPR && b->count ? b->cell[0] : NULL;
+  return h && h->type == LVAL_SYM && h->depth == LADDR_BUILDIN
+    && lbuildin_vals[h->slot].buildin == op;
+}
 
-  // reduce the count
-  v->count--;
-  v->cell = realloc(v->cell, sizeof(Lval*) * (v->count));
+// Add to r what x, a list in the body of a lambda v calls, holds when
+// that is known at the call: a Q-expression without names, a formal given
+// one, list applied to formals given global names or constants, or a join
+// of those. Formals are added as the caller's argument. False otherwise.
+static bool linline_list(Linline* in, Lval* v, Lval* x, Lval* r) {
+  if (x->type == LVAL_SYM && x->depth == 0) { x = v->cell[x->slot + 1]; }
+  if (x->type == LVAL_QEXPR) {
+    if (!lval_nameless(x)) { return false; }
+    for (int i = 0; i < x->count; i++) { lval_add(r, lval_copy(x->cell[i])); }
+    return true;
+  }
 
-  return x;
-};
+  bool join = linline_applies(x, buildin_join);
+  if (!join && !linline_applies(x, buildin_list)) { return false; }
+  for (int i = 1; i < x->count; i++) {
+    Lval* a = x->cell[i];
+    if (join) {
+      if (!linline_list(in, v, a, r)) { return false; }
+      continue;
+    }
+    // names in the body itself could mean something else in the caller
+    bool arg = a->type == LVAL_SYM && a->depth == 0;
+    if (arg) { a = v->cell[a->slot + 1]; }
+    bool name = arg && a->type == LVAL_SYM && a->depth == LADDR_GLOBAL && lenv_global(in->glob, a, NULL);
+    if (!name && (a->type == LVAL_SYM || a->type == LVAL_SEXPR || !lval_nameless(a))) { return false; }
+    lval_add(r, lval_copy(a));
+  }
+  return true;
+}
 
-Lval* lval_join(Lval* v, Lval* u) {
-  while(u->count != 0) {
-    lval_add(v, lval_pop(u, 0));
+// A call of a lambda whose body evaluates a list known at the call, say
+// stlib's unpack {eval (join (list f) xs)} given a list without names,
+// becomes the call the list is, depending on the lambda. The head has to
+// name a global lambda, which is then depended on too, or a builtin by its
+// own name that looks at no frame, since eval runs it in the callee's.
+static Lval* linline_spread(Linline* in, Lval* v, Lfun* g) {
+  Lval* b = g->body;
+  if (g->formals->count != v->count - 1 || b->count != 2) { return NULL; }
+  Lval* h = b->cell[0];
+  if (h->type != LVAL_SYM || h->depth != LADDR_BUILDIN
+      || lbuildin_vals[h->slot].buildin != buildin_eval) { return NULL; }
+
+  Lval* r = lval_sexp();
+  Lval* f = NULL;
+  if (linline_list(in, v, b->cell[1], r) && r->count && r->cell[0]->type == LVAL_SYM) {
+    f = lenv_global(in->glob, r->cell[0], NULL);
+  }
+  // rebinding a partial application demotes nothing
+  bool ok = f && f->type == LVAL_FUN && (f->buildin || !f->fun->base);
+  if (ok && f->buildin) {
+    int i = lbuildin_find(r->cell[0]);
+    ok = i >= 0 && lbuildin_vals[i].buildin == f->buildin
+      && (lbuildin_pure(f->buildin) || lvm_binop(f->buildin) >= 0);
+  }
+  if (!ok) {
+    lval_del(r);
+    return NULL;
   }
 
-  lval_del(u);
-  return v;
-};
+  if (!f->buildin) { linline_dep(in, f->fun); }
+  linline_dep(in, g);
+  for (int i = 0; i < in->ndeps; i++) { in->deps[i]->watched = true; }
+  lval_link(r, in->glob, true);
+  in->sites++;
+  return r;
+}
 
-Lenv* lenv_new(void) {
-  Lenv* e = malloc(sizeof(Lenv));
-  e->count = 0;
-  e->par = NULL;
-  e->syms = NULL;
-  e->vals = NULL;
-  e->status = NULL;
-  return e;
-};
+// The body of the lambda v calls with its arguments substituted, NULL
+// when the call has to stay. Arguments that are names or constants may be
+// evaluated where a formal is used instead of once beforehand, the others
+// see linline_order.
+static Lval* linline_call(Linline* in, Lval* v) {
+  Lval* h = v->cell[0];
+  if (h->type != LVAL_SYM || h->depth != LADDR_GLOBAL) { return NULL; }
+  Lval* f = lenv_global(in->glob, h, NULL);
+  if (!f || f->type != LVAL_FUN || f->buildin || f->fun->base) { return NULL; }
+  Lfun* g = f->fun;
+  if (g == in->fn || !g->linked || g->env) { return NULL; }
+  Lval* r = linline_spread(in, v, g);
+  if (r || g->formals->count != v->count - 1) { return r; }
+  if (lval_size(g->body) > LINLINE_SIZE || lval_mentions(g->body, h->sym)) { return NULL; }
+
+  int calls = 0;
+  for (int i = 1; i < v->count; i++) {
+    Lval* a = v->cell[i];
+    calls += a->type == LVAL_SEXPR;
+    if (a->type == LVAL_SYM && a->depth == LADDR_GLOBAL && !lenv_global(in->glob, a, NULL)) { return NULL; }
+  }
+  if (calls) {
+    Lorder o = { -1, 0, false };
+    if (!linline_order(g->body, v, true, false, &o) || o.used != calls) { return NULL; }
+  }
 
-void lenv_del(Lenv* e) {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
+  // what it depends on is only kept when it is inlined
+  int ndeps = in->ndeps;
+  if (!linline_ok(in, v, g->body, true)) {
+    in->ndeps = ndeps;
+    return NULL;
   }
+  linline_dep(in, g);
+  for (int i = 0; i < in->ndeps; i++) { in->deps[i]->watched = true; }
+
+  Lval* b = lval_copy(g->body);
+  b->type = LVAL_SEXPR;
+  linline_subst(b, v);
+  lval_link(b, in->glob, true);
+  in->sites++;
+  return b;
+}
 
-  free(e->syms);
-  free(e->status);
-  free(e->vals);
-  free(e);
-};
+// inline the calls in v, the S-expression of a body, and in the branches
+// of its ifs
+static Lval* linline_walk(Linline* in, Lval* v) {
+  Lval* h = v->count ? v->cell[0] : NULL;
+  bool branch = h && h->type == LVAL_SYM && h->depth == LADDR_BUILDIN
+    && lbuildin_vals[h->slot].buildin == buildin_if;
+  for (int i = 0; i < v->count; i++) {
+    Lval* x = v->cell[i];
+    if (x->type == LVAL_SEXPR) {
+      v->cell[i] = linline_walk(in, x);
+    } else if (branch && i >= 2 && x->type == LVAL_QEXPR) {
+      x->type = LVAL_SEXPR;
+      x = linline_walk(in, x);
+      x->type = LVAL_QEXPR;
+      v->cell[i] = x;
+    }
+  }
 
-Lval* lenv_get(Lenv* e, Lval* k) {
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(k->sym, e->syms[i]) == 0) {
-      return lval_copy(e->vals[i]); // internal immutable data structure
+  Lval* r = v->count ? linline_call(in, v) : NULL;
+  if (!r) { return v; }
+  lval_del(v);
+  return r;
+}
+
+// fn's body with calls inlined and folded again, NULL when nothing was
+// inlined. Without walk nothing is.
+static Lopt* linline_body(Lenv* glob, Lfun* fn, bool walk) {
+  Linline in = { glob, fn, NULL, 0, 0 };
+  Lval* body = lval_copy(fn->body);
+  if (walk) {
+    if (glob->shared) {
+      lenv_read_begin();
+      in.glob = __atomic_load_n(&glob->snap, __ATOMIC_SEQ_CST);
     }
+    body->type = LVAL_SEXPR;
+    body = linline_walk(&in, body);
+    body->type = LVAL_QEXPR;
+    if (glob->shared) { lenv_read_end(); }
   }
 
-  if (e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    return lval_err("unbound symbol %s", k->sym);
+  if (!in.sites) {
+    lval_del(body);
+    free(in.deps);
+    return NULL;
   }
-};
+  linline_stats.sites += in.sites;
+  Lopt* o = calloc(1, sizeof(Lopt));
+  o->body = lval_fold_branch(body, glob);
+  o->deps = in.deps;
+  o->ndeps = in.ndeps;
+  return o;
+}
+
+static void lenv_capture_walk(Lenv* e, Lval* formals, Lval* v, Lenv** cap) {
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+    for (int i = 0; i < v->count; i++) {
+      lenv_capture_walk(e, formals, v->cell[i], cap);
+    }
+    return;
+  }
+  if (v->type != LVAL_SYM || lval_formal(formals, v) >= 0) { return; }
+  if (*cap && lenv_find(*cap, v->sym, v->hash) >= 0) { return; }
+
+  for (Lenv* f = e; f && f != e->glob; f = f->par) {
+    int i = lenv_find(f, v->sym, v->hash);
+    if (i >= 0) {
+      if (!*cap) { *cap = lenv_new(); }
+      lenv_put(*cap, v, f->entries[i].val, 0);
+      return;
+    }
+  }
+}
+
+// Copy the free variables of body that e binds below its global frame
+// into a frame of their own, NULL if there are none
+Lenv* lenv_capture(Lenv* e, Lval* formals, Lval* body) {
+  Lenv* cap = NULL;
+  lenv_capture_walk(e, formals, body, &cap);
+  return cap;
+}
 
 void lenv_val_print(Lenv* e, Lval* k) {
   FILE* out = DEBUG ? stderr : stdout;
@@ -454,60 +2999,286 @@ void lenv_val_println(Lenv* e, Lval* k) {
 };
 void lenv_print(Lenv* e) {
   FILE* out = DEBUG ? stderr : stdout;
+  if (e->shared) {
+    lenv_read_begin();
+    lenv_print(__atomic_load_n(&e->snap, __ATOMIC_SEQ_CST));
+    lenv_read_end();
+    return;
+  }
   if (e->par) { lenv_print(e->par); }
+  if (e->base) { lenv_print(e->base); }
+  for (int i = 0; e->buildins && i < sizeof(lbuildin_vals) / sizeof(Lval); i++) {
+    fprintf(out, "%s => [%s](%s) ", lbuildin_names[i], ltype_name(lbuildin_vals[i].type), lenv_status_name(1));
+    lval_print(&lbuildin_vals[i]);
+    fputc('\n', out);
+  }
   for (int i = 0; i < e->count; i++) {
-    fprintf(out, "%s => [%s](%s) ", e->syms[i], ltype_name(e->vals[i]->type), lenv_status_name(e->status[i]));
-    lval_print(e->vals[i]);
+    Lentry* x = &e->entries[i];
+    fprintf(out, "%s => [%s](%s) ", x->sym, ltype_name(x->val->type), lenv_status_name(x->status));
+    lval_print(x->val);
     fputc('\n', out);
   };
 };
 
 Lenv* lenv_copy(Lenv* e) {
+  assert(!e->shared);
   Lenv* n = lenv_new();
 
   n->par = e->par;
+  n->glob = e->glob == e ? n : e->glob;
   n->count = e->count;
-  n->syms = malloc(sizeof(char*) * n->count);
-  n->vals = malloc(sizeof(Lval*) * n->count);
-  n->status = malloc(sizeof(bool) * n->count);
+  n->cap = e->count;
+  n->stack = false;
+  n->buildins = e->buildins;
+  n->bloom = e->bloom;
+  n->base = e->base;
+  if (n->base) { LREF_INC(n->base->ref); }
+  n->entries = malloc(sizeof(Lentry) * n->count);
 
   for (int i = 0; i < n->count; i++) {
-    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
-    n->status[i] = e->status[i];
+    n->entries[i] = e->entries[i];
+    n->entries[i].val = lval_copy(e->entries[i].val);
+    n->entries[i].version = lenv_stamp();
+  }
+
+  if (e->index) {
+    n->mask = e->mask;
+    n->index = malloc(sizeof(int) * (e->mask + 1));
+    memcpy(n->index, e->index, sizeof(int) * (e->mask + 1));
   }
 
   return n;
 }
 
+// Fork a global frame in O(1): its bindings move to a base frame that
+// both it and the fork read through to, and each side copies a binding
+// into its own table only when it defines or sets that name
+static void lmod_force(Lenv* g);
+static void lmod_settle(Lenv* g, Lval* k);
+
+Lenv* lenv_fork(Lenv* e) {
+  assert(!e->shared);
+  // pending imports would only load into one side
+  lmod_force(e);
+  if (e->count) {
+    Lenv* b = lenv_new();
+    b->count = e->count;
+    b->cap = e->cap;
+    b->entries = e->entries;
+    b->index = e->index;
+    b->mask = e->mask;
+    b->base = e->base;
+    b->bloom = e->bloom;
+
+    e->count = 0;
+    e->cap = 0;
+    e->entries = NULL;
+    e->index = NULL;
+    e->mask = 0;
+    e->base = b;
+    e->bloom = 0;
+    e->shape = lenv_stamp();
+  }
+
+  Lenv* n = lenv_new();
+  n->buildins = e->buildins;
+  n->base = e->base;
+  if (n->base) { LREF_INC(n->base->ref); }
+  return n;
+}
+
+// Share a global frame between threads. Its bindings move to a snapshot
+// that is never written again, def and = on the frame publish a changed
+// copy with one atomic store and lookups never take a lock.
+void lenv_share(Lenv* e) {
+  assert(e->glob == e && !e->shared);
+  // loading on a miss would race, imports are evaluated up front
+  lmod_force(e);
+  Lenv* t = lenv_new();
+  t->count = e->count;
+  t->cap = e->cap;
+  t->entries = e->entries;
+  t->index = e->index;
+  t->mask = e->mask;
+  t->buildins = e->buildins;
+  t->base = e->base;
+  t->bloom = e->bloom;
+
+  e->count = 0;
+  e->cap = 0;
+  e->entries = NULL;
+  e->index = NULL;
+  e->mask = 0;
+  e->base = NULL;
+  e->bloom = 0;
+  e->snap = t;
+  e->shared = true;
+  e->shape = lenv_stamp();
+}
+
+// a private copy of a snapshot's tables, the values stay shared with it
+static Lenv* lenv_snapshot(Lenv* t) {
+  Lenv* n = lenv_new();
+  n->count = t->count;
+  n->cap = t->count;
+  n->buildins = t->buildins;
+  n->bloom = t->bloom;
+  n->base = t->base;
+  if (n->base) { LREF_INC(n->base->ref); }
+  n->entries = malloc(sizeof(Lentry) * n->count);
+  memcpy(n->entries, t->entries, sizeof(Lentry) * n->count);
+
+  if (t->index) {
+    n->mask = t->mask;
+    n->index = malloc(sizeof(int) * (t->mask + 1));
+    memcpy(n->index, t->index, sizeof(int) * (t->mask + 1));
+  }
+  return n;
+}
+
+// Take out what no reader can see any more, the write lock is held.
+// It is freed by lenv_free_retired once the lock is let go, freeing a
+// lambda takes ltier_lock, which is held while inlining reads frames.
+static Lretired* lenv_reclaim_retired(void) {
+  unsigned long oldest = ULONG_MAX;
+  int n = __atomic_load_n(&lenv_reader_count, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < n; i++) {
+    unsigned long epoch = __atomic_load_n(&lenv_readers[i].epoch, __ATOMIC_SEQ_CST);
+    if (epoch && epoch < oldest) { oldest = epoch; }
+  }
+
+  Lretired* done = NULL;
+  for (Lretired** p = &lenv_retired; *p;) {
+    Lretired* x = *p;
+    if (x->epoch > oldest) { p = &x->next; continue; }
+    *p = x->next;
+    x->next = done;
+    done = x;
+  }
+  return done;
+}
+
+static void lenv_free_retired(Lretired* x) {
+  while (x) {
+    Lretired* next = x->next;
+    if (x->snap) { lenv_drop(x->snap); }
+    if (x->val) { lval_del(x->val); }
+    free(x);
+    x = next;
+  }
+}
+
+// def and = on a shared frame, readers see either the old snapshot or
+// the new one and writers take turns
+static bool lenv_publish(Lenv* g, Lval* k, Lval* v, bool status) {
+  pthread_mutex_lock(&lenv_write_lock);
+  Lenv* t = g->snap;
+  Lenv* n = lenv_snapshot(t);
+  Lval* old = NULL;
+  Lval* demoted = NULL; // demoted once the lock is let go, see above
+  bool err = 0;
+
+  int i = lenv_find(n, k->sym, k->hash);
+  if (i >= 0 && !n->entries[i].status) {
+    old = n->entries[i].val;
+    demoted = lval_copy(old);
+    n->entries[i].val = lval_copy(v);
+    n->entries[i].version = lenv_stamp();
+  } else {
+    err = i >= 0 ? ERR_BUILDIN : lenv_put(n, k, v, status);
+  }
+
+  if (err) {
+    lenv_drop(n);
+  } else {
+    __atomic_store_n(&g->snap, n, __ATOMIC_SEQ_CST);
+    Lretired* x = malloc(sizeof(Lretired));
+    x->snap = t;
+    x->val = old;
+    x->epoch = __atomic_add_fetch(&lenv_epoch, 1, __ATOMIC_SEQ_CST);
+    x->next = lenv_retired;
+    lenv_retired = x;
+  }
+
+  Lretired* done = lenv_reclaim_retired();
+  pthread_mutex_unlock(&lenv_write_lock);
+  lenv_free_retired(done);
+  if (demoted) {
+    ltier_demote(demoted, v);
+    lval_del(demoted);
+  }
+  return err;
+}
+
+void lenv_quiesce(void) {
+  pthread_mutex_lock(&lenv_write_lock);
+  Lretired* done = lenv_reclaim_retired();
+  pthread_mutex_unlock(&lenv_write_lock);
+  lenv_free_retired(done);
+}
+
 bool lenv_def(Lenv* e, Lval* k, Lval* v, bool status) {
-  while (e->par) { e = e->par; }
-  return lenv_put(e, k, v, status);
+  return lenv_put(e->glob, k, v, status);
 };
 
 bool lenv_put(Lenv* e, Lval* k, Lval* v, bool status) {
   assert(k->type == LVAL_SYM);
+  if (e->shared) { return lenv_publish(e, k, v, status); }
+  if (e->buildins && lbuildin_find(k) >= 0) { return ERR_BUILDIN; }
+  if (e->mod) { lmod_settle(e, k); }
 
   // for symbol exists in the env
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(k->sym, e->syms[i]) == 0) {
-      if (e->status[i]) { return ERR_BUILDIN; }
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return 0;
-    }
+  int i = lenv_find(e, k->sym, k->hash);
+  if (i >= 0) {
+    if (e->entries[i].status) { return ERR_BUILDIN; }
+    ltier_demote(e->entries[i].val, v);
+    lval_del(e->entries[i].val);
+    e->entries[i].val = lval_copy(v);
+    e->entries[i].version = lenv_stamp();
+    return 0;
   }
+
+  // names a base binds are copied on write, unless frozen there
+  for (Lenv* t = e->base; t; t = t->base) {
+    int j = lenv_find(t, k->sym, k->hash);
+    if (j >= 0 && t->entries[j].status) { return ERR_BUILDIN; }
+    if (j >= 0) { break; }
+  }
+
   // new symbols
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(Lval*) * e->count);
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
-  e->status = realloc(e->status, sizeof(bool) * e->count);
+  e->shape = lenv_stamp();
+  if (e->stack) {
+    // a call frame grows in place while it is on top of the stack
+    if (e->entries + e->count == lenv_stack + lenv_sp && lenv_sp < LENV_STACK_MAX) {
+      lenv_sp++;
+      e->cap++;
+    } else {
+      Lentry* entries = malloc(sizeof(Lentry) * (e->count * 2 + 1));
+      memcpy(entries, e->entries, sizeof(Lentry) * e->count);
+      e->entries = entries;
+      e->cap = e->count * 2 + 1;
+      e->stack = false;
+    }
+  } else if (e->count == e->cap) {
+    e->cap = e->cap ? e->cap * 2 : 4;
+    e->entries = realloc(e->entries, sizeof(Lentry) * e->cap);
+  }
 
-  e->status[e->count - 1] = status;
-  e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  Lentry* x = &e->entries[e->count++];
+  e->bloom |= LENV_BLOOM(k->hash);
+  x->status = status;
+  x->val = lval_copy(v);
+  x->version = lenv_stamp();
+  x->hash = k->hash;
+  x->sym = k->sym;
+
+  if (e->index && e->count * 2 <= e->mask + 1) {
+    unsigned long s = x->hash & e->mask;
+    while (e->index[s]) { s = (s + 1) & e->mask; }
+    e->index[s] = e->count;
+  } else if (e->count > LENV_LINEAR_MAX) {
+    lenv_reindex(e);
+  }
 
   return 0;
 };
@@ -526,52 +3297,352 @@ void lenv_add_boolean(Lenv* e, char* name, bool b) {
   lval_del(k); lval_del(v);
 }
 
+// the builtins are a static table, a global frame only chains to it
 void lenv_init_buildins(Lenv* e) {
-  /* List Functions */
-  lenv_add_buildin(e, "list", buildin_list);
-  lenv_add_buildin(e, "head", buildin_head);
-  lenv_add_buildin(e, "tail",  buildin_tail);
-  lenv_add_buildin(e, "eval", buildin_eval);
-  lenv_add_buildin(e, "join",  buildin_join);
-  lenv_add_buildin(e, "cons", buildin_cons);
-  lenv_add_buildin(e, "len",  buildin_len);
-  lenv_add_buildin(e, "init",  buildin_init);
-
-  /* Mathematical Functions */
-  lenv_add_buildin(e, "+", buildin_add);
-  lenv_add_buildin(e, "-", buildin_sub);
-  lenv_add_buildin(e, "*", buildin_mul);
-  lenv_add_buildin(e, "/", buildin_div);
-  lenv_add_buildin(e, "%", buildin_mod);
-
-  /* Variable Functions */
-  lenv_add_buildin(e, "def", buildin_def);
-  lenv_add_buildin(e, "=", buildin_put);
-  lenv_add_buildin(e, "exit", buildin_exit);
-  lenv_add_buildin(e, "lambda", buildin_lambda);
-
-  /* Comparison Functions */
-  lenv_add_buildin(e, "<", buildin_lt);
-  lenv_add_buildin(e, "<=", buildin_lteq);
-  lenv_add_buildin(e, ">", buildin_gt);
-  lenv_add_buildin(e, ">=", buildin_gteq);
-  lenv_add_buildin(e, "==", buildin_eq);
-  lenv_add_buildin(e, "!=", buildin_neq);
-
-  /* Conditionals */
-  lenv_add_buildin(e, "if", buildin_if);
-
-  /* Logic Operators */
-  lenv_add_buildin(e, "||", buildin_or);
-  lenv_add_buildin(e, "&&", buildin_and);
-  lenv_add_buildin(e, "!",  buildin_not);
-  lenv_add_buildin(e, "or", buildin_or);
-  lenv_add_buildin(e, "and", buildin_and);
-  lenv_add_buildin(e, "not",  buildin_not);
-
-  /* Boolean Values */
-  lenv_add_boolean(e, "true", 1);
-  lenv_add_boolean(e, "false", 0);
+  e->buildins = true;
+}
+
+static Lmodule* lmod_new(void) {
+  Lmodule* m = malloc(sizeof(Lmodule));
+  m->names = lenv_new();
+  m->forms = NULL;
+  m->count = 0;
+  m->files = NULL;
+  m->nfiles = 0;
+  return m;
+}
+
+static void lmod_del(Lmodule* m) {
+  lenv_del(m->names);
+  for (int i = 0; i < m->count; i++) { free(m->forms[i]); }
+  for (int i = 0; i < m->nfiles; i++) { free(m->files[i]); }
+  free(m->forms);
+  free(m->files);
+  free(m);
+}
+
+// the whole file, NULL if it cannot be read
+static char* lmod_read_file(char* path) {
+  FILE* f = fopen(path, "rb");
+  if (!f) { return NULL; }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* text = malloc(size + 1);
+  size = fread(text, 1, size, f);
+  text[size] = '\0';
+  fclose(f);
+  return text;
+}
+
+// length of the symbol or number at s
+static int lmod_token(char* s) {
+  int n = 0;
+  while (!strchr(" \t\r\n(){};", s[n])) { n++; }
+  return n;
+}
+
+// end of the top level expression at s
+static char* lmod_form_end(char* s) {
+  if (*s != '(' && *s != '{') {
+    int n = lmod_token(s);
+    return s + (n ? n : 1);
+  }
+  int depth = 0;
+  do {
+    if (*s == '(' || *s == '{') { depth++; }
+    if (*s == ')' || *s == '}') { depth--; }
+    s++;
+  } while (*s && depth);
+  return s;
+}
+
+static char* lmod_skip_space(char* s) {
+  while (*s && strchr(" \t\r\n", *s)) { s++; }
+  return s;
+}
+
+// end of a value at s that looks nothing up when evaluated: a number, a
+// Q-expression or a lambda, NULL for anything else
+static char* lmod_inert(char* s) {
+  if (*s == '{') { return lmod_form_end(s); }
+  if (*s == '(') {
+    char* h = lmod_skip_space(s + 1);
+    return lmod_token(h) == 6 && strncmp(h, "lambda", 6) == 0 ? lmod_form_end(s) : NULL;
+  }
+  int n = lmod_token(s);
+  int sign = *s == '-';
+  return n > sign && (int)strspn(s + sign, "0123456789") == n - sign ? s + n : NULL;
+}
+
+// whether g binds name or a module of g has it indexed
+static bool lmod_known(Lenv* g, char* name) {
+  Lval* k = lval_sym(name);
+  bool known = lenv_global(g, k, NULL) || lenv_find(g->mod->names, k->sym, k->hash) >= 0;
+  lval_del(k);
+  return known;
+}
+
+// Index a (def {names...} values...) form whose values are inert, or a
+// (fun {name formals...} {body}) form once fun is defined, under the
+// names it defines. Evaluating one later then gives what it gives now.
+// The module keeps src. False for any other form and for names already
+// defined, which the form has to redefine in order.
+static bool lmod_index(Lenv* g, Lmodule* m, char* src) {
+  char* s = lmod_skip_space(src + 1);
+  int n = lmod_token(s);
+  bool fun = n == 3 && strncmp(s, "fun", 3) == 0;
+  bool def = n == 3 && strncmp(s, "def", 3) == 0;
+  if (*src != '(' || !(fun || def)) { return false; }
+  if (fun && !lmod_known(g, "fun")) { return false; }
+
+  s = lmod_skip_space(s + n);
+  if (*s != '{') { return false; }
+  char* names = lmod_skip_space(s + 1);
+  int named = 0;
+  for (s = names; (n = lmod_token(s)); s = lmod_skip_space(s + n)) {
+    char name[n + 1];
+    memcpy(name, s, n);
+    name[n] = '\0';
+    if (lmod_known(g, name)) { return false; }
+    named++;
+  }
+  if (*s != '}' || !named) { return false; }
+
+  // a value per name, fun takes its formals and body
+  s = lmod_skip_space(s + 1);
+  for (int i = 0; i < (fun ? 1 : named); i++) {
+    s = fun && *s != '{' ? NULL : lmod_inert(s);
+    if (!s) { return false; }
+    s = lmod_skip_space(s);
+  }
+  if (*s != ')') { return false; }
+
+  for (s = names; (n = lmod_token(s)); s = lmod_skip_space(s + n)) {
+    char name[n + 1];
+    memcpy(name, s, n);
+    name[n] = '\0';
+    Lval* k = lval_sym(name);
+    Lval* v = lval_num(m->count);
+    lenv_put(m->names, k, v, 0);
+    lval_del(k); lval_del(v);
+    if (fun) { break; }
+  }
+
+  m->forms = realloc(m->forms, sizeof(char*) * (m->count + 1));
+  m->forms[m->count++] = src;
+  return true;
+}
+
+// read and evaluate src in g, the value of its last expression
+Lval* lval_read_string(char* name, char* src) {
+  mpc_result_t r;
+  if (!mpc_parse(name, src, Prog, &r)) {
+    char* msg = mpc_err_string(r.error);
+    Lval* err = lval_err("%s", msg);
+    mpc_err_delete(r.error);
+    free(msg);
+    return err;
+  }
+
+  Lval* prog = lval_read(r.output);
+  mpc_ast_delete(r.output);
+  return prog;
+}
+
+static Lval* lmod_eval(Lenv* g, char* src) {
+  Lval* prog = lval_read_string("<import>", src);
+  if (prog->type == LVAL_ERR) { return prog; }
+
+  Lval* x = lval_sexp();
+  while (prog->count && x->type != LVAL_ERR) {
+    lval_del(x);
+    x = lval_eval(g, lval_pop(prog, 0));
+  }
+  lval_del(prog);
+  return x;
+}
+
+// Evaluate the pending form that defines k, NULL if there is none. The
+// form is taken out first as evaluating it may look k up again.
+static Lval* lmod_load(Lenv* g, Lval* k) {
+  int i = lenv_find(g->mod->names, k->sym, k->hash);
+  if (i < 0) { return NULL; }
+
+  int form = g->mod->names->entries[i].val->num;
+  char* src = g->mod->forms[form];
+  if (!src) { return NULL; }
+  g->mod->forms[form] = NULL;
+
+  Lval* x = lmod_eval(g, src);
+  free(src);
+  return x;
+}
+
+// evaluate every pending form of g
+static void lmod_force(Lenv* g) {
+  for (int i = 0; g->mod && i < g->mod->count; i++) {
+    char* src = g->mod->forms[i];
+    if (!src) { continue; }
+    g->mod->forms[i] = NULL;
+    lval_del(lmod_eval(g, src));
+    free(src);
+  }
+}
+
+// k is about to be bound in g. A pending form defining it runs first, as
+// it would have on import, and binding fun anew runs every pending form,
+// fun forms call the one they were indexed under.
+static void lmod_settle(Lenv* g, Lval* k) {
+  if (strcmp(k->sym, "fun") == 0 && lenv_global(g, k, NULL)) {
+    lmod_force(g);
+    return;
+  }
+  Lval* x = lmod_load(g, k);
+  if (x) { lval_del(x); }
+}
+
+// Import the file at path into e's global frame: its definitions are
+// indexed and the rest runs in order. A file is imported once, unless a
+// form of it fails, the error is returned then.
+Lval* lmod_import(Lenv* e, char* path) {
+  Lenv* g = e->glob;
+  if (!g->mod) { g->mod = lmod_new(); }
+  Lmodule* m = g->mod;
+
+  for (int i = 0; i < m->nfiles; i++) {
+    if (strcmp(m->files[i], path) == 0) { return lval_sexp(); }
+  }
+
+  char* text = lmod_read_file(path);
+  if (!text) { return lval_err("cannot import %s", path); }
+  m->files = realloc(m->files, sizeof(char*) * (m->nfiles + 1));
+  m->files[m->nfiles] = malloc(strlen(path) + 1);
+  strcpy(m->files[m->nfiles++], path);
+  // names cached as unbound may be defined by the file now
+  g->shape = lenv_stamp();
+
+  Lval* x = lval_sexp();
+  for (char* s = lmod_skip_space(text); *s && x->type != LVAL_ERR; s = lmod_skip_space(s)) {
+    // comments run to the end of the line
+    if (*s == ';') {
+      while (*s && *s != '\n') { s++; }
+      continue;
+    }
+
+    char* end = lmod_form_end(s);
+    char* src = malloc(end - s + 1);
+    memcpy(src, s, end - s);
+    src[end - s] = '\0';
+    s = end;
+
+    if (!lmod_index(g, m, src)) {
+      lval_del(x);
+      x = lmod_eval(g, src);
+      free(src);
+    }
+  }
+  free(text);
+
+  // a shared frame does not load on a miss
+  if (g->shared) { lmod_force(g); }
+
+  // the rest of the file did not run, importing it again will
+  if (x->type == LVAL_ERR) {
+    free(m->files[--m->nfiles]);
+    return x;
+  }
+  lval_del(x);
+  return lval_sexp();
+}
+
+Lval* buildin_import(Lenv* e, Lval* l) {
+  LASSERT_NUM("import", l, 1);
+  LASSERT_TYPE("import", l, 0, LVAL_QEXPR);
+
+  Lval* names = l->cell[0];
+  for (int i = 0; i < names->count; i++) {
+    LASSERT_TYPE("import", names, i, LVAL_SYM);
+  }
+
+  // {stlib} names stlib.lisp
+  Lval* x = lval_sexp();
+  for (int i = 0; i < names->count && x->type != LVAL_ERR; i++) {
+    char* path = malloc(strlen(names->cell[i]->sym) + 6);
+    sprintf(path, "%s.lisp", names->cell[i]->sym);
+    lval_del(x);
+    x = lmod_import(e, path);
+    free(path);
+  }
+
+  lval_del(l);
+  return x;
+}
+
+static Lval* lstat(char* name, long n) {
+  Lval* v = lval_num(0);
+  v->num = n;
+  return lval_add(lval_add(lval_qexp(), lval_sym(name)), v);
+}
+
+// {name tier calls loops} of every lambda bound globally
+static Lval* ltier_stats(Lenv* g) {
+  if (g->shared) { lenv_read_begin(); }
+  Lenv* t = g->shared ? __atomic_load_n(&g->snap, __ATOMIC_SEQ_CST) : g;
+  Lval* x = lval_qexp();
+  for (int i = 0; i < t->count; i++) {
+    Lval* f = t->entries[i].val;
+    if (f->type != LVAL_FUN || f->buildin || f->fun->base) { continue; }
+    Lfun* fn = f->fun;
+    int tier = __atomic_load_n(&fn->tier, __ATOMIC_ACQUIRE);
+    char* name = tier == LTIER_TREE ? "tree"
+        : tier == LTIER_JIT ? (fn->jit->size ? "jit" : "aot")
+        : fn->code ? "vm" : "closure";
+    Lval* calls = lval_num(0);
+    Lval* loops = lval_num(0);
+    calls->num = __atomic_load_n(&fn->calls, __ATOMIC_RELAXED);
+    loops->num = __atomic_load_n(&fn->loops, __ATOMIC_RELAXED);
+    Lval* s = lval_add(lval_qexp(), lval_sym(t->entries[i].sym));
+    lval_add(x, lval_add(lval_add(lval_add(s, lval_sym(name)), calls), loops));
+  }
+  if (g->shared) { lenv_read_end(); }
+  return x;
+}
+
+Lval* buildin_stats(Lenv* e, Lval* l) {
+  LASSERT_NUM("stats", l, 1);
+  LASSERT_TYPE("stats", l, 0, LVAL_QEXPR);
+  LASSERT(l, l->cell[0]->count == 1 && l->cell[0]->cell[0]->type == LVAL_SYM,
+      "Function stats expects one name, {lookup}, {tier} or {inline}");
+
+  char* name = l->cell[0]->cell[0]->sym;
+  if (strcmp(name, "tier") == 0) {
+    lval_del(l);
+    return ltier_stats(e->glob);
+  }
+  if (strcmp(name, "inline") == 0) {
+    lval_del(l);
+    Lval* x = lval_qexp();
+    lval_add(x, lstat("sites", linline_stats.sites));
+    lval_add(x, lstat("stale", linline_stats.stale));
+    return x;
+  }
+  if (strcmp(name, "lookup") != 0) {
+    Lval* err = lval_err("no stats for %s", name);
+    lval_del(l);
+    return err;
+  }
+  lval_del(l);
+
+  Lval* x = lval_qexp();
+  lval_add(x, lstat("lookups", lenv_stats.lookups));
+  lval_add(x, lstat("addressed", lenv_stats.addressed));
+  lval_add(x, lstat("cached", lenv_stats.cached));
+  lval_add(x, lstat("frames", lenv_stats.frames));
+  lval_add(x, lstat("skipped", lenv_stats.skipped));
+  lval_add(x, lstat("chain-max", lenv_stats.chain_max));
+  lval_add(x, lstat("unbound", lenv_stats.unbound));
+  return x;
 }
 
 Lval* buildin_def(Lenv* e, Lval* l) { return buildin_var(e, l, "def"); }
@@ -593,7 +3664,12 @@ Lval* buildin_var(Lenv* e, Lval* l, char* func) {
   for (int i = 0; i < syms->count; i++) {
     bool error;
     if (strcmp(func, "def") == 0) { error = lenv_def(e, syms->cell[i], l->cell[i + 1], false); }
-    if (strcmp(func, "=")   == 0) { error = lenv_put(e, syms->cell[i], l->cell[i + 1], false); }
+    // lambdas call builtins by their own names without a lookup, whatever
+    // spells the = that could hide one in a call frame
+    if (strcmp(func, "=")   == 0) {
+      error = e != e->glob && lbuildin_find(syms->cell[i]) >= 0
+        ? ERR_BUILDIN : lenv_put(e, syms->cell[i], l->cell[i + 1], false);
+    }
     if (error == ERR_BUILDIN) {
       return lval_err("symbol declaration failed, %s names are taken", syms->cell[i]->sym);
     }
@@ -623,7 +3699,16 @@ Lval* buildin_lambda(Lenv* e, Lval* l) {
   Lval* body = lval_pop(l, 0);
   lval_del(l);
 
-  return lval_lambda(formals, body);
+  Lenv* cap = lenv_capture(e, formals, body);
+  lval_resolve(body, formals, cap, e->glob);
+  Lval* f = lval_lambda(formals, body, cap);
+  // an empty body is an error the tree walker reports
+  if (body->count && !lval_mentions(body, lsym_intern("=", lsym_hash("=")))) {
+    lval_link(body, e->glob, true);
+    f->fun->body = lval_fold_branch(body, e->glob);
+    f->fun->linked = true;
+  }
+  return f;
 };
 
 Lval* buildin_list(Lenv* e, Lval* l) {
@@ -706,101 +3791,107 @@ Lval* buildin_init(Lenv* e, Lval* l) {
   return ql;
 };
 
-Lval* buildin_op(Lenv* e, Lval* l, char* op) {
+// what the builtins of an op call it in their errors
+static char* lop_names[] = {
+  [LOP_ADD] = "+", [LOP_SUB] = "-", [LOP_MUL] = "*", [LOP_DIV] = "/",
+  [LOP_MOD] = "%", [LOP_LT] = "<", [LOP_LE] = "<=", [LOP_GT] = ">",
+  [LOP_GE] = ">=", [LOP_EQ] = "==", [LOP_NE] = "!=", [LOP_AND] = "&&",
+  [LOP_OR] = "||"
+};
+
+typedef long Larith_vec __attribute__((vector_size(4 * sizeof(long))));
+
+// the numbers in cell, four lanes at a time
+static long larith_sum(Lval** cell, int n) {
+  Larith_vec acc = { 0, 0, 0, 0 };
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    Larith_vec v = { cell[i]->num, cell[i + 1]->num, cell[i + 2]->num, cell[i + 3]->num };
+    acc += v;
+  }
+  long sum = acc[0] + acc[1] + acc[2] + acc[3];
+  for (; i < n; i++) { sum += cell[i]->num; }
+  return sum;
+}
+
+Lval* buildin_op(Lenv* e, Lval* l, int op) {
+  char* name = lop_names[op];
+  bool small = true; // every number fits in 32 bits
   for (int i = 0; i < l->count; i++) {
-    if (l->cell[i]->type != LVAL_NUM) {
+    Lval* x = l->cell[i];
+    if (x->type != LVAL_NUM) {
       Lval* err = lval_err("Function '%s' passed in incorrect type for args %d. Got %s, Expect %s",
-          op, i, ltype_name(l->cell[i]->type), ltype_name(LVAL_NUM));
+          name, i, ltype_name(x->type), ltype_name(LVAL_NUM));
       lval_del(l);
       return err;
     }
+    small &= (unsigned long)x->num + 0x80000000ul <= 0xfffffffful;
   }
 
-  Lval* x = lval_pop(l, 0); // Lval to hold the result
-
-  if (l->count == 0) {
-    if (strcmp(op, "-") == 0)  {
-      x->num = -x->num;
-    } else {
+  if (l->count < 2) {
+    if (op != LOP_SUB || !l->count) {
+      lval_del(l);
+      return lval_err("Invalid Operands for %s", name);
+    }
+    Lval* x = lval_take(l, 0);
+    if (x->num == LONG_MIN) {
       lval_del(x);
-      char *emsg = malloc(sizeof(char) * 256);
-      strcat(emsg, "Invalid Operands for ");
-      strcat(emsg, op);
-      x = lval_err(emsg);
-    }
-  }
-
-  while (l->count != 0) {
-    Lval* y = lval_pop(l, 0);
-    if (DEBUG) {
-      fprintf(stderr, "%s %ld %ld\n", op, x->num, y->num);
-      lval_println(l);
-    }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "^") == 0) { x->num = pow(x->num, y->num); }
-    if (strcmp(op, "%") == 0) { x->num %= y->num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x); lval_del(y); lval_del(l);
-        x = lval_err("Division By Zero!");
-        break;
-      } else {
-        x->num /= y->num;
-      }
+      return lval_err("Integer Overflow!");
     }
+    x->num = -x->num;
+    return x;
+  }
 
-    lval_del(y);
+  Lval* x = l->cell[0];
+  if ((op == LOP_ADD || op == LOP_SUB) && small && l->count > LARITH_VEC) {
+    long sum = larith_sum(l->cell + 1, l->count - 1);
+    x->num = op == LOP_ADD ? x->num + sum : x->num - sum;
+    return lval_take(l, 0);
   }
 
-  lval_del(l);
-  return x;
+  for (int i = 1; i < l->count; i++) {
+    if (!lvm_arith(op, x, l->cell[i])) {
+      bool zero = !l->cell[i]->num;
+      lval_del(l);
+      return lval_err(zero ? "Division By Zero!" : "Integer Overflow!");
+    }
+  }
+  return lval_take(l, 0);
 };
 
-Lval* buildin_add(Lenv* e, Lval* l) { return buildin_op(e, l, "+"); }
-Lval* buildin_sub(Lenv* e, Lval* l) { return buildin_op(e, l, "-"); }
-Lval* buildin_mul(Lenv* e, Lval* l) { return buildin_op(e, l, "*"); }
-Lval* buildin_div(Lenv* e, Lval* l) { return buildin_op(e, l, "/"); }
-Lval* buildin_mod(Lenv* e, Lval* l) { return buildin_op(e, l, "%"); }
-
-Lval* buildin_ord(Lenv* e, Lval* l, char* op) {
-  LASSERT_NUM(op, l, 2);
-  LASSERT_TYPE(op, l, 0, LVAL_NUM);
-  LASSERT_TYPE(op, l, 1, LVAL_NUM);
+Lval* buildin_add(Lenv* e, Lval* l) { return buildin_op(e, l, LOP_ADD); }
+Lval* buildin_sub(Lenv* e, Lval* l) { return buildin_op(e, l, LOP_SUB); }
+Lval* buildin_mul(Lenv* e, Lval* l) { return buildin_op(e, l, LOP_MUL); }
+Lval* buildin_div(Lenv* e, Lval* l) { return buildin_op(e, l, LOP_DIV); }
+Lval* buildin_mod(Lenv* e, Lval* l) { return buildin_op(e, l, LOP_MOD); }
 
-  int r;
+Lval* buildin_ord(Lenv* e, Lval* l, int op) {
+  char* name = lop_names[op];
+  LASSERT_NUM(name, l, 2);
+  LASSERT_TYPE(name, l, 0, LVAL_NUM);
+  LASSERT_TYPE(name, l, 1, LVAL_NUM);
 
-  if (strcmp(op, "<") == 0)  { r = (l->cell[0]->num < l->cell[1]->num); }
-  if (strcmp(op, "<=") == 0) { r = (l->cell[0]->num <= l->cell[1]->num); }
-  if (strcmp(op, ">") == 0)  { r = (l->cell[0]->num > l->cell[1]->num); }
-  if (strcmp(op, ">=") == 0) { r = (l->cell[0]->num >= l->cell[1]->num); }
-
-  lval_del(l);
-
-  return lval_num(r);
+  lvm_arith(op, l->cell[0], l->cell[1]);
+  return lval_take(l, 0);
 }
 
-Lval* buildin_lt(Lenv* e, Lval* l)   { return buildin_ord(e, l, "<"); }
-Lval* buildin_lteq(Lenv* e, Lval* l) { return buildin_ord(e, l, "<="); }
-Lval* buildin_gt(Lenv* e, Lval* l)   { return buildin_ord(e, l, ">"); }
-Lval* buildin_gteq(Lenv* e, Lval* l) { return buildin_ord(e, l, ">="); }
+Lval* buildin_lt(Lenv* e, Lval* l)   { return buildin_ord(e, l, LOP_LT); }
+Lval* buildin_lteq(Lenv* e, Lval* l) { return buildin_ord(e, l, LOP_LE); }
+Lval* buildin_gt(Lenv* e, Lval* l)   { return buildin_ord(e, l, LOP_GT); }
+Lval* buildin_gteq(Lenv* e, Lval* l) { return buildin_ord(e, l, LOP_GE); }
 
-Lval* buildin_cmp(Lenv* e, Lval* l, char* op) {
-  LASSERT_NUM(op, l, 2);
+Lval* buildin_cmp(Lenv* e, Lval* l, int op) {
+  LASSERT_NUM(lop_names[op], l, 2);
 
-  int r;
-
-  if (strcmp(op, "==") == 0)  { r =  lval_eq(l->cell[0], l->cell[1]); }
-  if (strcmp(op, "!=") == 0)  { r = !lval_eq(l->cell[0], l->cell[1]); }
+  int r = lval_eq(l->cell[0], l->cell[1]) ? op == LOP_EQ : op == LOP_NE;
 
   lval_del(l);
 
   return lval_num(r);
 }
 
-Lval* buildin_eq(Lenv* e, Lval* l)   { return buildin_cmp(e, l, "=="); }
-Lval* buildin_neq(Lenv* e, Lval* l)  { return buildin_cmp(e, l, "!="); }
+Lval* buildin_eq(Lenv* e, Lval* l)   { return buildin_cmp(e, l, LOP_EQ); }
+Lval* buildin_neq(Lenv* e, Lval* l)  { return buildin_cmp(e, l, LOP_NE); }
 
 Lval* buildin_if(Lenv* e, Lval* l)  {
   LASSERT(l, l->cell[0]->type == LVAL_NUM || l->cell[0]->type == LVAL_BOOL,
@@ -821,52 +3912,74 @@ Lval* buildin_if(Lenv* e, Lval* l)  {
   return r;
 }
 
-Lval* buildin_logic(Lenv* e, Lval* l, char* op) {
-  LASSERT_NUM(op, l, 2);
-  LASSERT_TYPE(op, l, 0, LVAL_NUM);
-  LASSERT_TYPE(op, l, 1, LVAL_NUM);
-
-  int r;
-
-  if (strcmp(op, "||") == 0)  { r = (l->cell[0]->num || l->cell[1]->num); }
-  if (strcmp(op, "&&") == 0)  { r = (l->cell[0]->num && l->cell[1]->num); }
-
-  lval_del(l);
+Lval* buildin_logic(Lenv* e, Lval* l, int op) {
+  char* name = lop_names[op];
+  LASSERT_NUM(name, l, 2);
+  LASSERT_TYPE(name, l, 0, LVAL_NUM);
+  LASSERT_TYPE(name, l, 1, LVAL_NUM);
 
-  return lval_num(r);
+  lvm_arith(op, l->cell[0], l->cell[1]);
+  return lval_take(l, 0);
 }
 
-Lval* buildin_or(Lenv* e, Lval* l)   { return buildin_logic(e, l, "||"); }
-Lval* buildin_and(Lenv* e, Lval* l)  { return buildin_logic(e, l, "&&"); }
+Lval* buildin_or(Lenv* e, Lval* l)   { return buildin_logic(e, l, LOP_OR); }
+Lval* buildin_and(Lenv* e, Lval* l)  { return buildin_logic(e, l, LOP_AND); }
 
 Lval* buildin_not(Lenv* e, Lval* l)  {
   LASSERT_NUM("!", l, 1);
   LASSERT_TYPE("!", l, 0, LVAL_NUM);
 
-  int v = l->cell[0]->num;
+  long v = l->cell[0]->num;
   lval_del(l);
 
   return lval_num(!v);
 }
+// Run the forms of a program, printing each result as the prompt does.
+// A lambda of integers lispyc compiled gets its code once the program
+// binds the name it was compiled under to a lambda, unless LISPY_NOJIT
+// is set.
+int lval_run(char* name, char* src, Laot* aot, int naot) {
+  lval_parser_init();
+  Lenv* e = lenv_new();
+  lenv_init_buildins(e);
+
+  Lval* prog = lval_read_string(name, src);
+  if (prog->type == LVAL_ERR) {
+    lval_println(prog);
+    lval_del(prog);
+    return 1;
+  }
+
+  for (int form = 0; prog->count; form++) {
+    Lval* x = lval_eval(e, lval_pop(prog, 0));
+    lval_println(x);
+    lval_del(x);
+
+    for (int i = 0; ljit_enabled() && i < naot; i++) {
+      if (aot[i].form != form) { continue; }
+      Lval* k = lval_sym(aot[i].name);
+      Lval* f = lenv_get(e, k);
+      if (f->type == LVAL_FUN && !f->buildin && !f->fun->base && !f->fun->jit) {
+        Ljit* j = calloc(1, sizeof(Ljit));
+        j->code = aot[i].code;
+        __atomic_store_n(&f->fun->jit, j, __ATOMIC_RELEASE);
+        __atomic_store_n(&f->fun->tier, LTIER_JIT, __ATOMIC_RELEASE);
+      }
+      lval_del(f);
+      lval_del(k);
+    }
+    lval_reclaim(INT_MAX);
+  }
+
+  lval_del(prog);
+  lval_parser_cleanup();
+  return 0;
+}
+
+#ifndef LISPY_NO_MAIN
 int main(int argc, const char *argv[])
 {
-  mpc_parser_t *Prog  = mpc_new("program");
-  mpc_parser_t *Expr = mpc_new("expr");
-  mpc_parser_t *Sexpr = mpc_new("sexpr");
-  mpc_parser_t *Qexpr = mpc_new("qexpr");
-  mpc_parser_t *Number = mpc_new("number");
-  mpc_parser_t *Symbol  = mpc_new("symbol");
-
-  mpca_lang(MPC_LANG_DEFAULT,
-      " \
-      symbol  : /[a-zA-Z0-9_+\\-*\\/%\\\\=<>!&\\|]+/; \
-      number  : /-?[0-9]+(\\.[0-9]+)?/; \
-      expr    : <number> | <symbol> | <sexpr> | <qexpr> ;\
-      sexpr   : '(' <expr>* ')';\
-      qexpr   : '{' <expr>* '}';\
-      program : /^/ <expr>* /$/;\
-      ",
-      Number, Symbol, Expr, Sexpr, Qexpr, Prog);
+  lval_parser_init();
 
   mpc_result_t r;
 
@@ -877,8 +3990,16 @@ int main(int argc, const char *argv[])
   Lenv* e = lenv_new();
   lenv_init_buildins(e);
 
+  // files on the command line are imported before the first prompt
+  for (int i = 1; i < argc; i++) {
+    Lval* x = lmod_import(e, (char*)argv[i]);
+    if (x->type == LVAL_ERR) { lval_println(x); }
+    lval_del(x);
+  }
+
   while (1) {
     char *input = readline("lispy> ");
+    if (!input) { break; } // end of input
     add_history(input);
     if (mpc_parse("<stdin>", input, Prog, &r)) {
       if (DEBUG) { mpc_ast_print(r.output); }
@@ -886,12 +4007,15 @@ int main(int argc, const char *argv[])
       lval_println(x);
       lval_del(x);
       mpc_ast_delete(r.output);
+      // the result is out, finish pending frees before the next prompt
+      lval_reclaim(INT_MAX);
     } else {
       mpc_err_print(r.error);
       mpc_err_delete(r.error);
     }
   }
 
-  mpc_cleanup(6, Number, Symbol, Expr, Sexpr, Qexpr, Prog);
+  lval_parser_cleanup();
   return 0;
 }
+#endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <math.h>
 #include <assert.h>
 
@@ -21,35 +22,242 @@ typedef struct Lval Lval;
 typedef struct Lenv Lenv;
 typedef Lval* (*Lbuildin)(Lenv*, Lval*);
 
+typedef struct Lentry Lentry;
+
+// Reference counts, values may be shared between evaluator threads
+#define LREF_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define LREF_DEC(x) __atomic_sub_fetch(&(x), 1, __ATOMIC_ACQ_REL)
+
+// Inline cache of a global reference, shared by a symbol and its copies
+typedef struct {
+  int ref;
+  unsigned long shape; // of the global frame when filled, 0 if empty
+  Lentry* entry; // the binding, NULL for a builtin
+  int buildin; // position in LBUILDINS, -1 if the name is unbound
+} Lcache;
+
 // Lisp Values for evaluation
+// Payloads of different types never coexist, so they share storage:
+// a value is 40 bytes on 64-bit builds instead of 80.
 struct Lval {
   enum LTYPE type;
+  int count; // for sexp
+
+  union {
+    long num; // for number
+
+    char* err; // for error messages
+
+    /* Symbol */
+    struct {
+      char* sym; // interned, equal names share one string
+      unsigned long hash; // of sym, computed once when the symbol is built
+      int depth; // lexical address, frames above the current one
+      int slot;  // entry in that frame, -1 if unresolved
+      Lcache* cache; // for symbols at LADDR_GLOBAL
+    };
+
+    /*  Function */
+    struct {
+      Lbuildin buildin;
+      struct Lfun* fun; // for lambdas, shared by every copy
+    };
+
+    // for sexp
+    struct Lval** cell;
+
+    // for a free slot in the heap
+    struct Lval* next;
+  };
+};
 
-  long num; // for number
+// Managed heap, values are carved out of contiguous chunks
+#define LVAL_CHUNK 1024
+Lval* lval_alloc(void);
+void lval_free(Lval* v);
 
-  char* err; // for error messages
-  char* sym; // for symbol
+// Deferred reclamation, long lists are released in bounded steps
+// instead of in one recursive sweep on the evaluation path
+#define LVAL_DEFER_FREE 1
+#define LVAL_DEFER_MIN 64     // lists at least this long are queued
+#define LVAL_DEFER_DEPTH 4096 // queue capacity, a full queue frees in place
+#define LVAL_DEFER_STEP 4     // children released per allocation
+void lval_reclaim(int budget);
 
-  /*  Function */
-  Lbuildin buildin;
-  Lenv* env;
+// Lambda shared by every copy of a function value, copying one is O(1).
+// A partial application only points at the lambda and holds the arguments
+// bound so far, the lambda is called once the rest of them arrive.
+typedef struct Lfun {
+  int ref;
   Lval* formals;
   Lval* body;
+  Lenv* env; // captured free variables, NULL if it captures nothing
+  unsigned long bloom; // of the formals, see LENV_BLOOM
+  struct Lfun* base; // the lambda partially applied, NULL for a lambda
+  Lval* args; // bound arguments of a partial application
+  struct Lcode* code; // body compiled to bytecode
+  struct Lnode* node; // body compiled to closures
+  bool linked; // body linked to the builtins, it can be compiled
+  int tier; // LTIER it runs in
+  int calls; // since it was made or last demoted
+  int loops; // tail calls back to itself, likewise
+  struct Ljit* jit; // body compiled to machine code
+  struct Lopt* opt; // body with calls inlined, NULL until one is
+  bool watched; // inlined code depends on its binding
+  unsigned long seen; // argument types while walked, see LTYPE_FORMALS
+} Lfun;
+
+// How lambda bodies run once they are hot, compiled to bytecode for a
+// stack machine or to a tree of closures. LEXEC_TREE keeps walking them.
+// Builds may pick another with -DLEXEC=, make check runs the tests under
+// LEXEC_VM as well.
+#define LEXEC_TREE 0
+#define LEXEC_VM 1
+#define LEXEC_CLOSURE 2
+#ifndef LEXEC
+#define LEXEC LEXEC_CLOSURE
+#endif
+
+// A lambda starts out walked as a tree. After LTIER_THRESHOLD calls and
+// loops it is compiled as LEXEC says, at LJIT_THRESHOLD calls to machine
+// code. Binding its name to something else sends it back to the tree and
+// restarts the counts, code compiled so far is kept for when it is hot
+// again. A body that uses = stays a tree.
+enum LTIER { LTIER_TREE, LTIER_COMPILED, LTIER_JIT };
+#define LTIER_THRESHOLD 16
+
+// Compiling a lambda inlines calls of small global lambdas whose
+// arguments are constants or names: their bodies, LINLINE_SIZE values at
+// most, run in place with the arguments for their formals. The result
+// holds while the lambdas it depends on keep their bindings, binding one
+// anew sends it back to the tree walker to be compiled again. A call
+// of a lambda that evaluates a list known at the call, stlib's unpack or
+// curry on a list without names say, becomes the call the list is. pack
+// is an ordinary lambda, & is a formal like any other, and fun is out of
+// scope: it defines a global, which no inlined code may.
+// Code replaced so far is kept, a call may still be running it, so after
+// LOPT_CHAIN_MAX rounds the body is compiled as written instead and that
+// code is kept for good.
+#define LINLINE_SIZE 24
+#define LOPT_CHAIN_MAX 8
+typedef struct Lopt {
+  Lval* body;
+  struct Lcode* code;
+  struct Lnode* node;
+  struct Lfun** deps; // by identity only, not counted
+  int ndeps;
+  bool stale;
+  struct Lopt* prev; // replaced, kept until the lambda is released
+} Lopt;
+
+// While a lambda is walked as a tree the types of the arguments of its
+// first LTYPE_FORMALS formals are recorded, four bits each: a number, a
+// Q-expression, anything else. Formals that only got numbers or only
+// Q-expressions are assumed to when it is compiled to closures. The
+// body is then compiled twice behind a check of the frame on entry, the
+// copy for the assumed types calls builtins proven to get numbers or
+// Q-expressions without their type checks.
+#define LTYPE_FORMALS 16
+
+// Bytecode, operands follow their op in the code
+#define LVM_STACK_MAX 65536
+enum LOP {
+  LOP_CONST,    // k: push a copy of constant k
+  LOP_LOCAL,    // i: push a copy of frame entry i
+  LOP_CAPTURE,  // i: push a copy of captured entry i
+  LOP_GLOBAL,   // k: look symbol constant k up
+  LOP_CALL,     // n: call the value under the top n with them
+  LOP_TAILCALL, // n: the same as the last thing a body does
+  LOP_BUILDIN,  // b n: call builtin b with the top n values
+  LOP_JUMPF,    // else end: pop a condition of if, go to else when false
+  LOP_JUMP,     // to
+  LOP_RETURN,
+  // b: two numbers on top, anything else goes to builtin b
+  LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_MOD,
+  LOP_LT, LOP_LE, LOP_GT, LOP_GE, LOP_EQ, LOP_NE,
+  // only run by the builtins
+  LOP_AND, LOP_OR
+};
+
+// The arithmetic builtins scan their arguments once for their types and
+// then fold them with the op's kernel, which the compiled code shares.
+// Overflow and division by zero are errors. Adding or subtracting more
+// than LARITH_VEC numbers that all fit in 32 bits cannot overflow, those
+// are summed four at a time in vector registers.
+#define LARITH_VEC 16
+
+typedef struct Lcode {
+  int* ops;
+  int count;
+  int cap;
+  Lval** consts; // borrowed from the body or the builtin table
+  int nconst;
+  int height; // values on the stack at this point of compiling
+  int depth;  // most values the code keeps on the stack
+} Lcode;
+Lcode* lvm_compile(Lval* body);
 
-  // for sexp
+// Closures: each node of a body runs through its own C function, chosen
+// when compiling, so running it takes no type switches or lookups by name
+typedef struct Lnode Lnode;
+typedef Lval* (*Lexec)(Lnode* n, Lenv* e);
+struct Lnode {
+  Lexec exec;
+  Lval* val; // a constant or the symbol of a global, borrowed from the body
+  int slot;  // entry of a local or captured read, position in LBUILDINS
   int count;
-  struct Lval** cell;
+  Lnode** kids;
 };
+Lnode* lnode_compile(Lval* body, unsigned types);
+
+// Template JIT for x86-64. Lambdas of integers, which only use their
+// formals, numbers, arithmetic, comparisons, if and calls of other such
+// lambdas, are compiled to machine code after LJIT_THRESHOLD calls.
+// Formals live in the caller's argument array and temporaries in rax,
+// rcx and the machine stack. Anything else, like an argument that is no
+// number or a division by zero, makes the code bail out and the call run
+// again in the interpreter. The code has no side effects, so running it
+// again is safe. Setting LISPY_NOJIT in the environment turns it off,
+// compiled lambdas are listed in /tmp/perf-<pid>.map for perf.
+#define LJIT_ENABLE 1
+#define LJIT_THRESHOLD 100
+#define LJIT_BAIL_MAX 100 // bail outs before a lambda goes back for good
+#define LJIT_ARGS_MAX 16
+
+// returned in rax and rdx
+typedef struct {
+  long val;
+  long bail;
+} Ljit_ret;
+
+typedef struct Ljit {
+  Ljit_ret (*code)(long* args, Lenv* glob);
+  size_t size; // of the mapping
+  int bails;
+} Ljit;
+
+// machine code being emitted, with the jumps to the bail out still open
+typedef struct {
+  unsigned char* buf;
+  int count;
+  int cap;
+  int* bails;
+  int nbail;
+  int depth; // 8 byte slots pushed since the prologue
+} Lasm;
+
+Ljit* ljit_compile(Lfun* fn);
 
 // Construction methods
-Lval* lval_num(int num);
+Lval* lval_num(long num);
 Lval* lval_bool(bool b);
 Lval* lval_err(char* fmt, ...);
 Lval* lval_sym(char* s);
 Lval* lval_sexp(void);
 Lval* lval_qexp(void);
 Lval* lval_fun(Lbuildin func);
-Lval* lval_lambda(Lval* formals, Lval* body);
+Lval* lval_lambda(Lval* formals, Lval* body, Lenv* env);
+Lval* lval_partial(Lfun* fn, Lval* args);
 Lval* lval_copy(Lval* l);
 
 // Destruction methods
@@ -70,14 +278,134 @@ Lval* lval_insert(Lval* v, Lval* a, int i);
 // Comparison
 int lval_eq(Lval* v, Lval* w);
 
+struct Lentry {
+  char* sym; // interned, not owned by the entry
+  unsigned long hash;
+  unsigned long version; // unique per binding, renewed whenever it changes
+  Lval* val;
+  bool status; // freeze status
+};
+
+// Frames up to LENV_LINEAR_MAX bindings are scanned linearly, larger ones
+// (the global environment) get an open addressing index over the entries
+#define LENV_LINEAR_MAX 8
+
+// Each frame keeps a 64-bit filter of the names it binds, two bits per
+// name hash. A frame missing either bit of a name cannot bind it and
+// lookups walking the chain skip it without a search.
+#define LENV_BLOOM(h) (1UL << ((h) & 63) | 1UL << ((h) >> 6 & 63))
+
+// Count lookups, frames walked and filter and cache hits, (stats {lookup})
+#define LENV_STATS 1
+
+// Scope is lexical: a call frame's parent is the frame of its closure's
+// captures. Globals are looked up in glob, the global frame of the caller.
+// A forked global frame reads through to the bindings it was forked from,
+// kept in a shared base frame that nobody writes to.
+// A shared global frame keeps its bindings in snap instead, an immutable
+// frame that writers replace as a whole, so threads read without locks.
 struct Lenv {
   int count;
+  int cap;
   Lenv* par;
-  char** syms;
-  Lval** vals;
-  bool* status; // freeze status
+  Lenv* glob; // the frame itself for a global frame
+  Lentry* entries; // in definition order
+  int* index; // entry position + 1 per slot, 0 for an empty slot
+  int mask;   // index size - 1, the size is a power of two
+  bool stack; // entries live in the call stack region
+  bool buildins; // chains to the static builtin table, set on global frames
+  Lenv* base; // bindings shared with forks, read only
+  int ref;    // for base frames, one per frame reading through
+  unsigned long shape; // renewed whenever a binding is added
+  bool shared; // global frame read by several threads, see lenv_share
+  Lenv* snap;  // its current bindings when shared
+  struct Lmodule* mod; // imported definitions, evaluated on first lookup
+  unsigned long bloom; // names bound here, see LENV_BLOOM
 };
 
+// Builtins shared read-only by every global frame: name, kind, value.
+// mkbuildins turns the names into a perfect hash, buildins.h. No frame
+// may bind their names but formals and captured variables.
+#define LBUILDINS(X) \
+  /* List Functions */ \
+  X("list", FUN, buildin_list) \
+  X("head", FUN, buildin_head) \
+  X("tail", FUN, buildin_tail) \
+  X("eval", FUN, buildin_eval) \
+  X("join", FUN, buildin_join) \
+  X("cons", FUN, buildin_cons) \
+  X("len", FUN, buildin_len) \
+  X("init", FUN, buildin_init) \
+  /* Mathematical Functions */ \
+  X("+", FUN, buildin_add) \
+  X("-", FUN, buildin_sub) \
+  X("*", FUN, buildin_mul) \
+  X("/", FUN, buildin_div) \
+  X("%", FUN, buildin_mod) \
+  /* Variable Functions */ \
+  X("def", FUN, buildin_def) \
+  X("=", FUN, buildin_put) \
+  X("exit", FUN, buildin_exit) \
+  X("lambda", FUN, buildin_lambda) \
+  X("import", FUN, buildin_import) \
+  X("stats", FUN, buildin_stats) \
+  /* Comparison Functions */ \
+  X("<", FUN, buildin_lt) \
+  X("<=", FUN, buildin_lteq) \
+  X(">", FUN, buildin_gt) \
+  X(">=", FUN, buildin_gteq) \
+  X("==", FUN, buildin_eq) \
+  X("!=", FUN, buildin_neq) \
+  /* Conditionals */ \
+  X("if", FUN, buildin_if) \
+  /* Logic Operators */ \
+  X("||", FUN, buildin_or) \
+  X("&&", FUN, buildin_and) \
+  X("!", FUN, buildin_not) \
+  X("or", FUN, buildin_or) \
+  X("and", FUN, buildin_and) \
+  X("not", FUN, buildin_not) \
+  /* Boolean Values */ \
+  X("true", BOOL, 1) \
+  X("false", BOOL, 0)
+
+// Call frames take their entries from one preallocated region per thread,
+// a frame that does not fit gets heap entries instead
+#define LENV_STACK_MAX 65536
+
+// Calls nested deeper than this return an error instead of running out
+// of C stack. How much stack a call takes depends on the build and on
+// what it goes through, eval say, so a call is also refused once the
+// calls under way on its thread leave less than LEVAL_STACK_RESERVE
+// bytes, or an eighth if that is more, of the stack getrlimit reports.
+#define LEVAL_DEPTH_MAX 10000
+#define LEVAL_STACK_RESERVE (256 * 1024)
+extern __thread int leval_depth; // calls in progress, ahead of time code counts its own in it
+// the stack getrlimit reports, 8MB if unlimited, threads that evaluate
+// are to be created with this much
+long leval_stack_limit(void);
+
+// A pending step of the walks over nested values, which keep them on a
+// stack of their own rather than recursing: the value, its counterpart
+// when copying or comparing, and the next cell
+typedef struct {
+  Lval* v;
+  Lval* w;
+  int i;
+} Lwork;
+
+unsigned long lsym_hash(char* s);
+char* lsym_intern(char* s, unsigned long hash);
+
+// Lexical addressing, depth of a symbol resolved to the global frame and
+// of a call head linked to a builtin, whose slot is then its position in
+// LBUILDINS
+#define LADDR_GLOBAL -1
+#define LADDR_BUILDIN -2
+void lval_resolve(Lval* v, Lval* formals, Lenv* cap, Lenv* glob);
+void lval_link(Lval* v, Lenv* glob, bool code);
+Lenv* lenv_capture(Lenv* e, Lval* formals, Lval* body);
+
 Lenv* lenv_new(void);
 void lenv_del(Lenv* e);
 Lval* lenv_get(Lenv* e, Lval* k);
@@ -90,10 +418,13 @@ void lenv_val_print(Lenv* e, Lval* k);
 void lenv_val_println(Lenv* e, Lval* k);
 void lenv_print(Lenv* e);
 Lenv* lenv_copy(Lenv* e);
+Lenv* lenv_fork(Lenv* e); // an independent session of e, forks of one frame run on one thread
+void lenv_share(Lenv* e); // make a global frame safe to read from any thread
+void lenv_quiesce(void);  // free what shared frames retired, no reader may see it
 char* lenv_status_name(int t);
 
 // buildin functions
-Lval* buildin_op(Lenv* e, Lval* l, char* op);
+Lval* buildin_op(Lenv* e, Lval* l, int op);
 Lval* buildin_list(Lenv* e, Lval* l); // (list 1 2 3 4)   => {1 2 3 4}
 Lval* buildin_head(Lenv* e, Lval* l); // (head {1 2 3})   => {1}
 Lval* buildin_tail(Lenv* e, Lval* l); // (tail {1 2 3})   => {2 3}
@@ -114,20 +445,22 @@ Lval* buildin_def(Lenv* e, Lval* l);
 Lval* buildin_put(Lenv* e, Lval* l);
 Lval* buildin_exit(Lenv* e, Lval* l);
 Lval* buildin_lambda(Lenv* e, Lval* l);
+Lval* buildin_import(Lenv* e, Lval* l); // (import {stlib}) reads stlib.lisp
+Lval* buildin_stats(Lenv* e, Lval* l);  // (stats {lookup}) => {{lookups 12} ...}
 
-Lval* buildin_ord(Lenv* e, Lval* l, char* op);
+Lval* buildin_ord(Lenv* e, Lval* l, int op);
 Lval* buildin_lt(Lenv* e, Lval* l);
 Lval* buildin_lteq(Lenv* e, Lval* l);
 Lval* buildin_gt(Lenv* e, Lval* l);
 Lval* buildin_gteq(Lenv* e, Lval* l);
 
-Lval* buildin_cmp(Lenv* e, Lval* l, char* op);
+Lval* buildin_cmp(Lenv* e, Lval* l, int op);
 Lval* buildin_eq(Lenv* e, Lval* l);
 Lval* buildin_neq(Lenv* e, Lval* l);
 
 Lval* buildin_if(Lenv* e, Lval* l);
 
-Lval* buildin_logic(Lenv* e, Lval* l, char* op);
+Lval* buildin_logic(Lenv* e, Lval* l, int op);
 Lval* buildin_or(Lenv* e, Lval* l);
 Lval* buildin_and(Lenv* e, Lval* l);
 Lval* buildin_not(Lenv* e, Lval* l);
@@ -138,5 +471,37 @@ Lval* lval_eval(Lenv* e, Lval* v);
 Lval* lval_call(Lenv* e, Lval* f, Lval* l);
 
 // API with AST
+void lval_parser_init(void);
+void lval_parser_cleanup(void);
 Lval* lval_read_num(mpc_ast_t* t);
 Lval* lval_read(mpc_ast_t* t);
+Lval* lval_read_string(char* name, char* src); // the forms in src
+
+// Ahead of time compiled programs. lispyc translates the lambdas of
+// integers a program defines to C, see LJIT_ENABLE, and the program runs
+// through lval_run. Code goes to the lambda bound to name right after
+// the top level form that defines it has run, never to one an import or
+// another form binds. LISPY_NOJIT leaves every lambda to the
+// interpreter here as well. Builds with LISPY_NO_MAIN link repl.c without the
+// prompt.
+typedef struct {
+  char* name;
+  Ljit_ret (*code)(long* args, Lenv* glob);
+  int form; // index of the form among the program's
+} Laot;
+int lval_run(char* name, char* src, Laot* aot, int naot);
+
+// Modules: importing a file only indexes the names that its def forms with
+// constant or lambda values and its fun forms define, when those names are
+// new. Such a form is read and evaluated when a lookup of one of them first
+// misses or the name is about to be bound. Every other top level form runs
+// on import in file order. A file whose form fails is not marked imported
+// and the import returns the error.
+typedef struct Lmodule {
+  Lenv* names;  // binds each indexed name to the position of its form
+  char** forms; // source of each form, NULL once evaluated
+  int count;
+  char** files; // imported paths, a file is imported once
+  int nfiles;
+} Lmodule;
+Lval* lmod_import(Lenv* e, char* path);
@@ -0,0 +1,17 @@
+(def {sq} (lambda {x} {* x x}))
+(def {sumsq} (lambda {n acc} {if (== n 0) {acc} {sumsq (- n 1) (+ acc (sq n))}}))
+(sumsq 1000 0)
+(def {cube} (lambda {x} {* x (* x x)}))
+(def {sumcube} (lambda {n acc} {if (== n 0) {acc} {sumcube (- n 1) (+ acc (cube n))}}))
+(sumcube 100 0)
+(def {collatz} (lambda {n steps} {if (== n 1) {steps} {collatz (if (== (% n 2) 0) {/ n 2} {+ (* 3 n) 1}) (+ steps 1)}}))
+(collatz 27 0)
+(def {safe} (lambda {a b} {if (== b 0) {0} {/ a b}}))
+(safe 10 0)
+(safe 10 3)
+(sq {2})
+(def {twice} (lambda {f x} {f (f x)}))
+(twice sq 3)
+(def {sq} (lambda {x} {+ x x}))
+(sumsq 10 0)
+(sq 9223372036854775807)
@@ -0,0 +1,12 @@
+(def {set} =)
+(def {f} (lambda {x} {list (set {+} x) (+ 1 2)}))
+(f 5)
+(def {g} (lambda {x} {list (= {+} x) (+ 1 2)}))
+(g 5)
+(def {loop} (lambda {n} {if (== n 0) {f 5} {loop (- n 1)}}))
+(loop 40)
+(def {h} (lambda {x} {list (set {y} x) y}))
+(h 5)
+(def {k} (lambda {list} {+ 1 (eval (head list))}))
+(k {4 5})
+(= {+} 1)
@@ -0,0 +1,19 @@
+(def {three} (lambda {a b c} {list a b c}))
+(three 1 {2} (+ 1 2))
+(three 1 2 3 4)
+(three (/ 1 0) 2 3)
+(def {sum3} (lambda {a b c} {+ a b c}))
+(def {loop} (lambda {n acc} {if (== n 0) {acc} {loop (- n 1) (sum3 acc n 1)}}))
+(loop 3000 0)
+(def {down} (lambda {n} {if (== n 0) {0} {+ 1 (down (- n 1))}}))
+(down 2000)
+(def {swap} (lambda {a b n} {if (== n 0) {list a b} {swap b a (- n 1)}}))
+(swap {x} {y} 7)
+(def {hold} (lambda {a b} {lambda {c} {list a b c}}))
+(def {held} (hold {1 2} 3))
+(sum3 10 20 30)
+(held 4)
+(def {same} (lambda {a b} {== a b}))
+(same {1 2} {1 2})
+(def {ack} (lambda {m n} {if (== m 0) {+ n 1} {if (== n 0) {ack (- m 1) 1} {ack (- m 1) (ack m (- n 1))}}}))
+(ack 2 3)
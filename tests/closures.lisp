@@ -0,0 +1,25 @@
+(def {adder} (lambda {n} {lambda {x} {+ x n}}))
+(def {add2} (adder 2))
+(def {add5} (adder 5))
+(add2 10)
+(add5 10)
+(add2 1)
+(def {n} 1000)
+(add2 0)
+(def {compose} (lambda {f g} {lambda {x} {f (g x)}}))
+((compose add2 add5) 1)
+(def {pair} (lambda {a b} {lambda {pick} {if pick {a} {b}}}))
+(def {p} (pair {1 2} 3))
+(p 1)
+(p 0)
+(def {twice} (lambda {f} {lambda {x} {f (f x)}}))
+((twice (twice add5)) 0)
+(def {loop} (lambda {k acc} {if (== k 0) {acc} {loop (- k 1) (+ acc ((adder k) k))}}))
+(loop 100 0)
+(def {keep} (lambda {xs} {lambda {i} {eval (head (if (== i 0) {xs} {tail xs}))}}))
+(def {kp} (keep {7 8 9}))
+(kp 0)
+(kp 1)
+(def {q} (lambda {x} {lambda {y} {lambda {z} {list x y z}}}))
+(((q 1) 2) 3)
+add2
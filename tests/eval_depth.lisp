@@ -0,0 +1,6 @@
+(def {fun} (lambda {args body} {def (head args) (lambda (tail args) body)}))
+(fun {down n} {if (== n 0) {0} {+ 1 (eval {down (- n 1)})}})
+(down 100)
+(down 9000)
+(down 100000)
+(down 100)
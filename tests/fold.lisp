@@ -0,0 +1,26 @@
+(def {a} (lambda {x} {+ x (* 2 3) (- 10 4)}))
+a
+(a 1)
+(def {b} (lambda {x} {if (> 2 1) {x} {0}}))
+b
+(b 7)
+(def {c} (lambda {x} {if x {/ 1 0} {5}}))
+c
+(c 0)
+(c 1)
+(def {d} (lambda {x} {+ x (len {1 2 3}) (eval (head {4 5}))}))
+d
+(d 0)
+(def {e} (lambda {x} {+ x (* 9223372036854775807 2)}))
+(e 1)
+(def {f} (lambda {+} {+ 1 2}))
+(f -)
+(def {g} (lambda {x} {if (== 1 2) {head x} {tail x}}))
+g
+(g {1 2 3})
+(def {h} (lambda {x} {(+ 1 1) x}))
+(h 3)
+(def {k} (lambda {x} {list (== {1} {1}) (!= 1 1) (% 7 0)}))
+(k 0)
+(def {loop} (lambda {n acc} {if (== n 0) {acc} {loop (- n 1) (+ acc (a n) (d n) (b (* 2 2)))}}))
+(loop 100 0)
@@ -0,0 +1,164 @@
+// Checks of the global frame variants that take C to set up, see
+// lenv_share. Prints what fails and exits with 1 if anything did.
+#include "mpc.h"
+#include "repl.h"
+
+static int failed = 0;
+
+// the result of the last form of src, printed into buf
+static char* run(Lenv* e, char* src, char* buf, int n) {
+  Lval* prog = lval_read_string("<frames>", src);
+  Lval* x = lval_sexp();
+  while (prog->type != LVAL_ERR && prog->count) {
+    lval_del(x);
+    x = lval_eval(e, lval_pop(prog, 0));
+  }
+  if (prog->type == LVAL_ERR) {
+    lval_del(x);
+    x = prog;
+  } else {
+    lval_del(prog);
+  }
+  if (x->type == LVAL_NUM) { snprintf(buf, n, "%ld", x->num); }
+  else if (x->type == LVAL_ERR) { snprintf(buf, n, "error %s", x->err); }
+  else { snprintf(buf, n, "%s", ltype_name(x->type)); }
+  lval_del(x);
+  return buf;
+}
+
+static void expect(char* what, Lenv* e, char* src, char* want) {
+  char buf[256];
+  run(e, src, buf, sizeof(buf));
+  if (strcmp(buf, want) != 0) {
+    printf("%s: %s gave %s, expected %s\n", what, src, buf, want);
+    failed = 1;
+  }
+}
+
+// lookups cached before the frame was shared must not outlive its entries
+static void check_share(void) {
+  Lenv* g = lenv_new();
+  lenv_init_buildins(g);
+  expect("share", g, "(def {v} 1) (def {f} (lambda {x} {+ x v})) (f 0)", "1");
+  expect("share", g, "(def {loop} (lambda {n} {if (== n 0) {(f 0)} {loop (- n 1)}})) (loop 200)", "1");
+  lenv_share(g);
+  expect("share", g, "(def {v} 1000) (f 0)", "1000");
+  expect("share", g, "(loop 200)", "1000");
+  lenv_quiesce();
+  expect("share", g, "(def {v} 7) (def {w} 8) (+ (f 0) w)", "15");
+  lenv_del(g);
+}
+
+// globals far beyond the first index size, redefined and read back, and
+// a lambda with more formals than a frame starts out with
+static void check_table(void) {
+  Lenv* g = lenv_new();
+  lenv_init_buildins(g);
+  char src[128], want[32];
+  for (int i = 0; i < 3000; i++) {
+    snprintf(src, sizeof(src), "(def {g%d} %d)", i, i);
+    expect("table", g, src, "S-Expression");
+  }
+  for (int i = 0; i < 3000; i += 2) {
+    snprintf(src, sizeof(src), "(def {g%d} (- 0 %d))", i, i);
+    expect("table", g, src, "S-Expression");
+  }
+  for (int i = 0; i < 3000; i += 7) {
+    snprintf(src, sizeof(src), "(+ g%d 0)", i);
+    snprintf(want, sizeof(want), "%d", i % 2 ? i : -i);
+    expect("table", g, src, want);
+  }
+  expect("table", g, "(def {+} 1)", "error symbol declaration failed, + names are taken");
+  expect("table", g, "(def {wide} (lambda {a b c d e f g h i j k l m n o p q r} {- r (+ a q)}))"
+    " (wide 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18)", "0");
+  expect("table", g, "(wide 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 g2999)", "2981");
+  lenv_del(g);
+}
+
+// global frames all read the one static builtin table, what one of them
+// defines stays in it
+static void check_buildins(void) {
+  Lenv* a = lenv_new();
+  lenv_init_buildins(a);
+  expect("buildins", a, "(def {len2} (lambda {x} {* 2 (len x)})) (len2 {1 2 3})", "6");
+  for (int i = 0; i < 200; i++) {
+    Lenv* b = lenv_new();
+    lenv_init_buildins(b);
+    expect("buildins", b, "(if true {+ (len {1 2}) (eval (head {3 4}))} {0})", "5");
+    expect("buildins", b, "(len2 {1})", "error unbound symbol len2");
+    expect("buildins", b, "(def {len} 1)", "error symbol declaration failed, len names are taken");
+    lenv_del(b);
+  }
+  expect("buildins", a, "(len2 {1})", "2");
+  lenv_del(a);
+}
+
+// forks start from their parent's bindings and see nothing any of the
+// others define afterwards, though they call the same lambdas
+static void check_fork(void) {
+  Lenv* g = lenv_new();
+  lenv_init_buildins(g);
+  char* loop = "(def {loop} (lambda {n acc} {if (== n 0) {acc} {loop (- n 1) (+ acc (f 0))}})) (loop 20 0)";
+  expect("fork", g, "(def {v} 1) (def {f} (lambda {x} {+ x v}))", "S-Expression");
+  expect("fork", g, loop, "20");
+  Lenv* a = lenv_fork(g);
+  Lenv* b = lenv_fork(g);
+  expect("fork", a, "(def {v} 2) (loop 20 0)", "40");
+  expect("fork", b, "(loop 20 0)", "20");
+  expect("fork", b, "(def {w} 5) (def {v} 3) (+ w (loop 20 0))", "65");
+  expect("fork", g, "(def {v} 4) (loop 20 0)", "80");
+  expect("fork", a, "(+ (loop 20 0) v)", "42");
+  expect("fork", a, "w", "error unbound symbol w");
+  expect("fork", g, "w", "error unbound symbol w");
+  Lenv* c = lenv_fork(b);
+  expect("fork", c, "(= {v} 6) (+ w (loop 20 0))", "125");
+  expect("fork", b, "(loop 20 0)", "60");
+  lenv_del(b);
+  expect("fork", c, "(+ w v)", "11");
+  lenv_del(a);
+  lenv_del(c);
+  expect("fork", g, "(loop 20 0)", "80");
+  lenv_del(g);
+}
+
+// the chain of code replaced for f, -1 if its code is not the latest
+static int chain(Lenv* e, char* name) {
+  Lval* k = lval_sym(name);
+  Lval* f = lenv_get(e, k);
+  int n = 0;
+  for (Lopt* o = f->fun->opt; o; o = o->prev) { n++; }
+  if (f->fun->opt && f->fun->node != f->fun->opt->node) { n = -1; }
+  lval_del(f);
+  lval_del(k);
+  return n;
+}
+
+// code compiled for a lambda that no longer inlines anything is not
+// compiled again on every promotion
+static void check_inline(void) {
+  Lenv* g = lenv_new();
+  lenv_init_buildins(g);
+  char* hot = "(def {loop} (lambda {n} {if (== n 0) {(f 1)} {loop (- n (/ (f 1) (f 1)))}})) (loop 40)";
+  expect("inline", g, "(def {inc} (lambda {x} {+ x 1})) (def {f} (lambda {x} {inc x}))", "S-Expression");
+  expect("inline", g, hot, "2");
+  int n = chain(g, "f");
+  if (n != 1) { printf("inline: f has %d inlined versions, expected 1\n", n); failed = 1; }
+  expect("inline", g, "(def {inc} (lambda {x} {if (== x 0) {0} {+ (inc (- x 1)) 2}})) (loop 40)", "2");
+  for (int i = 0; i < 4; i++) {
+    expect("inline", g, "(def {inc} (lambda {x} {if (== x 0) {0} {+ (inc (- x 1)) 3}})) (loop 40)", "3");
+  }
+  n = chain(g, "f");
+  if (n != 2) { printf("inline: f has %d versions after it stopped inlining, expected 2\n", n); failed = 1; }
+  lenv_del(g);
+}
+
+int main(void) {
+  lval_parser_init();
+  check_share();
+  check_table();
+  check_buildins();
+  check_fork();
+  check_inline();
+  lval_parser_cleanup();
+  return failed;
+}
@@ -0,0 +1,18 @@
+(def {build} (lambda {n acc} {if (== n 0) {acc} {build (- n 1) (cons n acc)}}))
+(def {sum} (lambda {xs acc} {if (== xs {}) {acc} {sum (tail xs) (+ acc (eval (head xs)))}}))
+(def {xs} (build 2000 {}))
+(len xs)
+(sum xs 0)
+(def {ys} xs)
+(def {xs} {})
+(len ys)
+(eval (head (tail ys)))
+(def {nest} (lambda {n acc} {if (== n 0) {acc} {nest (- n 1) (cons (list n {a b} (list n n)) acc)}}))
+(def {zs} (nest 800 {}))
+(len zs)
+(head zs)
+(== zs (nest 800 {}))
+(== zs (nest 799 {}))
+{1 a {b (c d)} {}}
+(list 9223372036854775807 -9223372036854775807 head (lambda {x} {x}))
+(list 1 (/ 1 0))
@@ -0,0 +1,21 @@
+(def {fib} (lambda {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))
+(fib 20)
+(def {gcd} (lambda {a b} {if (== b 0) {a} {gcd b (% a b)}}))
+(def {gcds} (lambda {n acc} {if (== n 0) {acc} {gcds (- n 1) (+ acc (gcd (* n 6) 84))}}))
+(gcds 300 0)
+(def {sum} (lambda {f a n acc} {if (== n 0) {acc} {sum f a (- n 1) (+ acc (f a n) (f n a))}}))
+(def {div} (lambda {a b} {/ a b}))
+(sum div 1000 200 0)
+(div 7 0)
+(div -7 2)
+(% -7 2)
+(div {1} 2)
+(def {cmp} (lambda {a b} {if (>= a b) {1} {if (!= a b) {-1} {0}}}))
+(sum cmp 100 200 0)
+(cmp true 1)
+(cmp 3 {3})
+(cmp 3 3)
+(def {big} (lambda {x y} {- (* x 4294967296) y}))
+(sum big 3 150 0)
+(big 9223372036854775807 0)
+(fib 21)
@@ -0,0 +1,9 @@
+(! 4294967296)
+(! 0)
+(! -4294967296)
+(&& 4294967296 1)
+(|| 0 4294967296)
+(def {big} (lambda {x} {! (* x 4294967296)}))
+(def {loop} (lambda {n acc} {if (== n 0) {acc} {loop (- n 1) (+ acc (big 1) (! 8589934592))}}))
+(loop 40 0)
+(big 0)
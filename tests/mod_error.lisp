@@ -0,0 +1,3 @@
+(def {before} 1)
+(nosuchfn 3)
+(def {after} 2)
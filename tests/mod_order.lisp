@@ -0,0 +1,9 @@
+(def {a} 1)
+(def {c} (+ a 10))
+(def {a} 50)
+(def {base} 5)
+(def {derived} (* base 2))
+(def {m1 m2} 1 2)
+(fun {twice x} {* 2 x})
+(def {late} (lambda {x} {+ x later}))
+(def {later} 3)
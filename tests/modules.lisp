@@ -0,0 +1,21 @@
+(import {stlib})
+(import {tests/mod_order})
+c
+a
+derived
+(def {base} 100)
+derived
+(def {m1} 9)
+m1
+m2
+(twice 4)
+(def {twice} (lambda {x} {* 3 x}))
+(twice 4)
+(late 1)
+(import {tests/mod_error})
+before
+after
+(import {tests/mod_error})
+(def {nosuchfn} (lambda {x} {x}))
+(import {tests/mod_error})
+after
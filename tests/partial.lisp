@@ -0,0 +1,20 @@
+(def {add3} (lambda {a b c} {+ a b c}))
+(def {add1} (add3 1))
+(add1 2 3)
+(add1 10 20)
+((add3 1 2) 3)
+(((add3 1) 2) 3)
+(def {add12} (add1 2))
+(add12 3)
+(add12 4)
+(add1 5 6)
+add12
+(add1 1 2 3)
+(def {tag} (lambda {t x} {list t x}))
+(def {tagged} (tag {k}))
+(tagged 1)
+(def {loop} (lambda {n acc} {if (== n 0) {acc} {loop (- n 1) (+ acc (add1 n 0) ((add3 n) n n))}}))
+(loop 100 0)
+(def {add3} (lambda {a b c} {* a b c}))
+(add1 2 3)
+((add3 2) 3 4)
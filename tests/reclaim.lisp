@@ -0,0 +1,14 @@
+(def {build} (lambda {n acc} {if (== n 0) {acc} {build (- n 1) (cons n acc)}}))
+(def {big} (build 100 {}))
+(def {churn} (lambda {n acc} {if (== n 0) {acc} {churn (- n 1) (+ acc (len (join big big)))}}))
+(churn 5000 0)
+(def {wide} (lambda {n acc} {if (== n 0) {acc} {wide (- n 1) (cons big acc)}}))
+(len (wide 80 {}))
+(def {double} (lambda {n xs} {if (== n 0) {xs} {double (- n 1) (join xs xs)}}))
+(def {w} (double 6 (wide 80 {})))
+(len w)
+(def {w} 0)
+(churn 3 0)
+(len (tail (join big big big)))
+(eval (head (tail (tail big))))
+(churn 10 0)
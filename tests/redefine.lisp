@@ -0,0 +1,20 @@
+(def {g} (lambda {x} {+ x 1}))
+(def {k} 10)
+(def {use} (lambda {n acc} {if (== n 0) {acc} {use (- n 1) (+ acc (g n) k)}}))
+(use 50 0)
+(def {g} (lambda {x} {* x 2}))
+(use 50 0)
+(= {k} 0)
+(use 50 0)
+(def {g} -)
+(use 50 0)
+(def {g} 5)
+(use 50 0)
+(def {g} (lambda {x} {x}))
+(def {flip} (lambda {n acc} {if (== n 0) {acc} {flip (- n 1) (+ acc (g n) (step n))}}))
+(def {step} (lambda {n} {eval (head (list 0 (if (== (% n 2) 0) {def {g} (lambda {x} {0})} {def {g} (lambda {x} {x})})))}))
+(flip 40 0)
+(def {later} (lambda {x} {+ x fresh}))
+(later 1)
+(def {fresh} 41)
+(later 1)
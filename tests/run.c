@@ -0,0 +1,24 @@
+// Runs a program without the prompt, printing the result of each top
+// level form, for the checks in this directory.
+//   tests/run prog.lisp
+#include "mpc.h"
+#include "repl.h"
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: tests/run prog.lisp\n");
+    return 2;
+  }
+  FILE* f = fopen(argv[1], "rb");
+  if (!f) {
+    fprintf(stderr, "tests/run: cannot read %s\n", argv[1]);
+    return 1;
+  }
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* text = malloc(n + 1);
+  text[fread(text, 1, n, f)] = '\0';
+  fclose(f);
+  return lval_run(argv[1], text, NULL, 0);
+}
@@ -0,0 +1,24 @@
+(def {y} 100)
+(def {f} (lambda {x} {+ x y z}))
+(f 1)
+(def {z} 10)
+(f 1)
+(def {y} 200)
+(f 1)
+(def {shadow} (lambda {y} {+ y 1}))
+(shadow 5)
+(def {outer} (lambda {a b} {(lambda {b c} {list a b c}) 20 30}))
+(outer 1 2)
+(def {caller} (lambda {x} {f 0}))
+(caller 7)
+(def {peek} (lambda {q} {+ q x}))
+(def {call-peek} (lambda {x} {peek 1}))
+(call-peek 5)
+(def {count} (lambda {n acc} {if (== n 0) {acc} {count (- n 1) (+ acc y)}}))
+(count 5000 0)
+(def {g} (lambda {head} {len head}))
+(g {1 2 3})
+(def {args} (lambda {a b c} {list c b a}))
+(args 1 2 3)
+(def {deep} (lambda {a} {(lambda {b} {(lambda {c} {+ a b c y}) 3}) 2}))
+(deep 1)
@@ -0,0 +1,17 @@
+(import {stlib})
+(def {six} (lambda {x} {+ x (unpack + {1 2 3})}))
+(def {spread} (lambda {f a b} {eval (join (list f) a b)}))
+(def {diff} (lambda {x} {+ x (spread - {20} {3 4})}))
+(def {name} (lambda {f} {eval (list f 5)}))
+(def {neg} (lambda {x} {- 0 x}))
+(def {five} (lambda {x} {+ x (name neg)}))
+(def {loop} (lambda {n acc} {if (== n 0) {acc} {loop (- n 1) (+ (six 0) (diff 0) (five 0))}}))
+(loop 40 0)
+(stats {inline})
+(def {unpack} (lambda {f xs} {eval (join (list f) (tail xs))}))
+(loop 40 0)
+(def {neg} (lambda {x} {* 2 x}))
+(loop 40 0)
+(def {spread} (lambda {f a b} {eval (join (list f) b a)}))
+(loop 40 0)
+(stats {inline})
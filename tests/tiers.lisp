@@ -0,0 +1,19 @@
+(def {inc} (lambda {x} {+ x 1}))
+(def {loop} (lambda {n acc} {if (== n 0) {acc} {loop (- n 1) (inc acc)}}))
+(loop 5 0)
+(stats {tier})
+(loop 200 0)
+(def {inc} (lambda {x} {+ x 2}))
+(stats {tier})
+(loop 200 0)
+(loop 3 0)
+(def {inc} (lambda {x} {- x 1}))
+(loop 3 0)
+(stats {tier})
+(def {fib} (lambda {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))
+(fib 15)
+(def {old} fib)
+(def {fib} (lambda {n} {n}))
+(stats {tier})
+(old 15)
+(fib 15)
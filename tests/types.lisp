@@ -0,0 +1,19 @@
+(def {each} (lambda {f x n acc} {if (== n 0) {acc} {each f x (- n 1) (+ acc (f x))}}))
+(def {num} (lambda {x} {+ (* x 2) (- x 1)}))
+(each num 5 40 0)
+(num {5})
+(num 5)
+(def {lst} (lambda {xs} {len (join (tail xs) xs)}))
+(each lst {1 2 3} 40 0)
+(lst 4)
+(lst {1})
+(def {cmp} (lambda {a b} {if (< a b) {a} {b}}))
+(def {each2} (lambda {f n acc} {if (== n 0) {acc} {each2 f (- n 1) (+ acc (f n 20))}}))
+(each2 cmp 40 0)
+(cmp {1} 2)
+(cmp 1 true)
+(def {mixed} (lambda {x} {if (== x {}) {0} {len x}}))
+(def {each3} (lambda {n acc} {if (== n 0) {acc} {each3 (- n 1) (+ acc (mixed {1 2}) (mixed {}))}}))
+(each3 40 0)
+(mixed 3)
+(num (* 2 3))
@@ -0,0 +1,20 @@
+(import {stlib})
+(def {probe} (lambda {x} {+ x missing}))
+(probe 1)
+(probe 1)
+(def {try} (lambda {n} {if (== n 0) {0} {try (- n 1)}}))
+(try 30)
+(probe 1)
+(def {missing} 5)
+(probe 1)
+(def {xs} {10 20 30 40 50 60 70 80 90 100})
+(nth 7 xs)
+(last xs)
+(def {deep} (lambda {n} {if (== n 0) {nth 9 xs} {deep (- n 1)}}))
+(deep 2000)
+(def {walk} (lambda {n} {if (== n 0) {later} {walk (- n 1)}}))
+(walk 50)
+(def {later} 3)
+(walk 50)
+(def {f} (lambda {xs} {lambda {n} {nth n xs}}))
+((f {7 8 9}) 2)